@@ -3,22 +3,100 @@
 #include </home/matthew/janet/janet.h>
 #include <stdio.h>
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static Janet safe_ckeywordv(const char *s) {
     return s ? janet_ckeywordv(s) : janet_wrap_nil();
 }
 
+typedef struct {
+    unsigned int code;
+    char sqlstate[6];
+    char message[1024];
+} jmy_error_t;
+
+static int error_get(void *p, Janet key, Janet *out) {
+    jmy_error_t *err = (jmy_error_t *)p;
+    if (!janet_checktype(key, JANET_KEYWORD)) {
+        return 0;
+    }
+    const uint8_t *k = janet_unwrap_keyword(key);
+    if (!janet_cstrcmp(k, "errno")) {
+        *out = janet_wrap_number(err->code);
+    } else if (!janet_cstrcmp(k, "sqlstate")) {
+        *out = janet_cstringv(err->sqlstate);
+    } else if (!janet_cstrcmp(k, "message")) {
+        *out = janet_cstringv(err->message);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static void error_to_string(void *p, JanetBuffer *buffer) {
+    jmy_error_t *err = (jmy_error_t *)p;
+    janet_buffer_push_cstring(buffer, err->message);
+}
+
+static const JanetAbstractType error_type = {
+    "mysql/error",
+    NULL,
+    NULL,
+    error_get,
+    NULL,
+    NULL,
+    NULL,
+    error_to_string,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+/* Errors carry the mysql error number and SQLSTATE so callers can tell
+ * deadlocks and lock wait timeouts from other failures. */
+static Janet make_error(const char *where, unsigned int code, const char *sqlstate, const char *message) {
+    jmy_error_t *err = (jmy_error_t *)janet_abstract(&error_type, sizeof(jmy_error_t));
+    err->code = code;
+    snprintf(err->sqlstate, sizeof(err->sqlstate), "%s", sqlstate ? sqlstate : "HY000");
+    snprintf(err->message, sizeof(err->message), "%s failed: code=%d error=%s", where, code, message);
+    return janet_wrap_abstract(err);
+}
+
 static void stmt_panic(MYSQL_STMT *statement, const char *where) {
-    char buf[1024];
-    snprintf(buf, sizeof(buf), "%s failed: code=%d error=%s", where, mysql_stmt_errno(statement), mysql_stmt_error(statement));
-    janet_panic(buf);
+    janet_panicv(make_error(where, mysql_stmt_errno(statement), mysql_stmt_sqlstate(statement), mysql_stmt_error(statement)));
 }
 
 static void conn_panic(MYSQL *conn, const char *where) {
-    char buf[1024];
-    snprintf(buf, sizeof(buf), "%s failed: code=%d error=%s", where, mysql_errno(conn), mysql_error(conn));
-    janet_panic(buf);
+    janet_panicv(make_error(where, mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn)));
+}
+
+static Janet error_p(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    return janet_wrap_boolean(janet_checkabstract(argv[0], &error_type) != NULL);
+}
+
+static Janet error_errno(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_error_t *err = (jmy_error_t *)janet_getabstract(argv, 0, &error_type);
+    return janet_wrap_number(err->code);
+}
+
+static Janet error_sqlstate(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_error_t *err = (jmy_error_t *)janet_getabstract(argv, 0, &error_type);
+    return janet_cstringv(err->sqlstate);
 }
 
 typedef struct {
@@ -68,55 +146,497 @@ static Janet result_affected_rows(int32_t argc, Janet *argv) {
     return janet_wrap_number(result->affected_rows);
 }
 
+/* Prefetching: a native thread reads an unbuffered text result ahead of
+ * the Janet thread, copying rows into batches queued in a bounded ring.
+ * The rows and the connection share the prefetch, which is freed when
+ * both let go of it. */
+
+#define PREFETCH_NULL ((unsigned long)-1)
+
+typedef struct {
+    int rows;
+    int capacity;
+    unsigned long *lengths;
+    size_t *offsets;
+    char *data;
+    size_t size;
+    size_t data_capacity;
+} jmy_batch_t;
+
+typedef struct {
+    MYSQL *conn;
+    MYSQL_RES *r;
+    int num_fields;
+    int batch_rows;
+    int depth;
+    jmy_batch_t **ring;
+    int head;
+    int count;
+    bool running;
+    bool done;
+    bool cancel;
+    unsigned int error_code;
+    char sqlstate[6];
+    char message[512];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_t thread;
+    int refs;
+    /* The mysql/rows being read, kept alive by the connection meanwhile. */
+    void *rows;
+} jmy_prefetch_t;
+
+static void batch_free(jmy_batch_t *b) {
+    if (b != NULL) {
+        free(b->lengths);
+        free(b->offsets);
+        free(b->data);
+        free(b);
+    }
+}
+
+static jmy_batch_t *batch_new(int num_fields, int rows) {
+    jmy_batch_t *b = calloc(1, sizeof(jmy_batch_t));
+    if (b == NULL) {
+        return NULL;
+    }
+    b->capacity = rows;
+    b->lengths = malloc(sizeof(unsigned long) * rows * num_fields);
+    b->offsets = malloc(sizeof(size_t) * rows * num_fields);
+    if (b->lengths == NULL || b->offsets == NULL) {
+        batch_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* Copy a row, keeping each cell NUL terminated as decode_text expects. */
+static bool batch_push(jmy_batch_t *b, int num_fields, MYSQL_ROW row, unsigned long *lengths) {
+    size_t need = b->size;
+    for (int j = 0; j < num_fields; j++) {
+        need += row[j] ? lengths[j] + 1 : 0;
+    }
+    if (need > b->data_capacity) {
+        size_t capacity = b->data_capacity ? b->data_capacity : 4096;
+        while (capacity < need) {
+            capacity *= 2;
+        }
+        char *data = realloc(b->data, capacity);
+        if (data == NULL) {
+            return false;
+        }
+        b->data = data;
+        b->data_capacity = capacity;
+    }
+    for (int j = 0; j < num_fields; j++) {
+        int cell = b->rows * num_fields + j;
+        b->offsets[cell] = b->size;
+        if (row[j] == NULL) {
+            b->lengths[cell] = PREFETCH_NULL;
+            continue;
+        }
+        b->lengths[cell] = lengths[j];
+        memcpy(b->data + b->size, row[j], lengths[j]);
+        b->data[b->size + lengths[j]] = '\0';
+        b->size += lengths[j] + 1;
+    }
+    b->rows++;
+    return true;
+}
+
+static void *prefetch_worker(void *arg) {
+    jmy_prefetch_t *p = (jmy_prefetch_t *)arg;
+    mysql_thread_init();
+
+    bool last = false;
+    while (!last) {
+        jmy_batch_t *b = batch_new(p->num_fields, p->batch_rows);
+        bool oom = b == NULL;
+        while (!oom && b->rows < p->batch_rows) {
+            MYSQL_ROW row = mysql_fetch_row(p->r);
+            if (row == NULL) {
+                break;
+            }
+            oom = !batch_push(b, p->num_fields, row, mysql_fetch_lengths(p->r));
+        }
+        last = oom || b->rows < p->batch_rows;
+
+        pthread_mutex_lock(&p->lock);
+        if (oom) {
+            p->error_code = CR_OUT_OF_MEMORY;
+            strcpy(p->sqlstate, "HY000");
+            strcpy(p->message, "out of memory prefetching rows");
+        } else if (last && mysql_errno(p->conn)) {
+            p->error_code = mysql_errno(p->conn);
+            snprintf(p->sqlstate, sizeof(p->sqlstate), "%s", mysql_sqlstate(p->conn));
+            snprintf(p->message, sizeof(p->message), "%s", mysql_error(p->conn));
+        }
+        while (p->count == p->depth && !p->cancel) {
+            pthread_cond_wait(&p->space, &p->lock);
+        }
+        if (p->cancel || oom || b->rows == 0) {
+            batch_free(b);
+            last = last || p->cancel;
+        } else {
+            p->ring[(p->head + p->count) % p->depth] = b;
+            p->count++;
+        }
+        if (last) {
+            p->done = true;
+        }
+        pthread_cond_signal(&p->ready);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    mysql_thread_end();
+    return NULL;
+}
+
+/* Stop the reader thread, if it is still going, and drop queued batches. */
+static void prefetch_join(jmy_prefetch_t *p) {
+    if (p->running) {
+        pthread_mutex_lock(&p->lock);
+        p->cancel = true;
+        pthread_cond_broadcast(&p->space);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+        p->running = false;
+    }
+    while (p->count > 0) {
+        batch_free(p->ring[p->head]);
+        p->head = (p->head + 1) % p->depth;
+        p->count--;
+    }
+}
+
+static void prefetch_release(jmy_prefetch_t *p) {
+    prefetch_join(p);
+    if (--p->refs > 0) {
+        return;
+    }
+    pthread_cond_destroy(&p->space);
+    pthread_cond_destroy(&p->ready);
+    pthread_mutex_destroy(&p->lock);
+    free(p->ring);
+    free(p);
+}
+
+/* How one column of a result is decoded, see resolve_decoders. */
+typedef struct {
+    Janet (*text)(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn);
+    Janet (*binary)(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn);
+    /* The function registered for the column, or nil. */
+    Janet fn;
+} jmy_decoder_t;
+
+static Janet decode_text_with(const jmy_decoder_t *d, char *v, unsigned long l, MYSQL_FIELD *field) {
+    return v == NULL ? janet_wrap_nil() : d->text(v, l, field, d->fn);
+}
+
+static Janet decode_binary_with(const jmy_decoder_t *d, MYSQL_BIND *bind, MYSQL_FIELD *field) {
+    return *bind->is_null ? janet_wrap_nil() : d->binary(bind, field, d->fn);
+}
+
+static jmy_decoder_t *resolve_decoders(MYSQL_FIELD *fields, int num_fields);
+
 typedef struct {
     MYSQL_STMT *statement;
     MYSQL_RES *r;
     int num_fields;
+    /* false if rows are read from the network as they are fetched. */
+    bool buffered;
+    /* The statement or context the rows came from, kept alive with them. */
+    Janet owner;
+    uint32_t execution;
+    /* Set while a thread reads the rows ahead, see rows-prefetch. */
+    jmy_prefetch_t *prefetch;
+    /* One per column, resolved when the rows are created. */
+    jmy_decoder_t *decoders;
 } jmy_rows_t;
 
+static bool rows_statement_current(jmy_rows_t *rows);
+
 static void __ensure_rows_ok(jmy_rows_t *ctx) {
     if (ctx->r == NULL) {
         janet_panic("mysql/rows is disconnected");
     }
+    if (ctx->statement != NULL && !rows_statement_current(ctx)) {
+        janet_panic("mysql/rows belong to a statement that was closed or executed again");
+    }
+    if (ctx->prefetch != NULL) {
+        janet_panic("mysql/rows are being prefetched, use rows-next-batch");
+    }
 }
 
 static int rows_gc(void *p, size_t s) {
     (void)s;
     jmy_rows_t *rows = (jmy_rows_t *)p;
+    if (rows->prefetch) {
+        prefetch_release(rows->prefetch);
+        rows->prefetch = NULL;
+    }
     if (rows->r) {
         mysql_free_result(rows->r);
         rows->r = NULL;
     }
+    janet_free(rows->decoders);
+    rows->decoders = NULL;
+    return 0;
+}
+
+static int rows_gcmark(void *p, size_t s) {
+    (void)s;
+    jmy_rows_t *rows = (jmy_rows_t *)p;
+    janet_mark(rows->owner);
+    if (rows->decoders != NULL) {
+        for (int j = 0; j < rows->num_fields; j++) {
+            janet_mark(rows->decoders[j].fn);
+        }
+    }
     return 0;
 }
 
+static int64_t rows_count(jmy_rows_t *rows) {
+    if (!rows->buffered) {
+        return -1;
+    }
+    if (rows->statement != NULL) {
+        return (int64_t)mysql_stmt_num_rows(rows->statement);
+    }
+    return (int64_t)mysql_num_rows(rows->r);
+}
+
+/* Approximate bytes held by a stored result, so the collector runs before
+ * unreferenced results pile up. max_length is known for stored results. */
+static void rows_gcpressure(jmy_rows_t *rows) {
+    int64_t n = rows_count(rows);
+    if (n <= 0) {
+        return;
+    }
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    size_t row_bytes = 0;
+    for (int j = 0; j < rows->num_fields; j++) {
+        row_bytes += fields[j].max_length + sizeof(char *) + 1;
+    }
+    janet_gcpressure(row_bytes * (size_t)n);
+}
+
 static void rows_to_string(void *p, JanetBuffer *buffer) {
     jmy_rows_t *rows = (jmy_rows_t *)p;
-    __ensure_rows_ok(rows);
+    if (rows->r == NULL) {
+        janet_buffer_push_cstring(buffer, "disconnected");
+        return;
+    }
+    if (rows->statement != NULL && !rows_statement_current(rows)) {
+        janet_buffer_push_cstring(buffer, "stale");
+        return;
+    }
 
-    janet_buffer_push_cstring(buffer, "result: ");
-    if (rows->r) {
-        janet_buffer_push_cstring(buffer, "...");
+    int64_t n = rows_count(rows);
+    if (n < 0) {
+        janet_formatb(buffer, "unbuffered, %d columns", rows->num_fields);
+    } else {
+        janet_formatb(buffer, "%d rows, %d columns", (int32_t)n, rows->num_fields);
     }
 }
 
+static int rows_get(void *p, Janet key, Janet *out);
+static Janet rows_call(void *p, int32_t argc, Janet *argv);
+static Janet rows_next(void *p, Janet key);
+static size_t rows_length(void *p, size_t size);
+
 static const JanetAbstractType rows_type = {
     "mysql/rows",
     rows_gc,
+    rows_gcmark,
+    rows_get,
     NULL,
     NULL,
     NULL,
+    rows_to_string,
     NULL,
     NULL,
-    rows_to_string,
+    rows_next,
+    rows_call,
+    rows_length
+};
+
+/* Snapshots are decoded results saved by rows-save in a columnar file,
+ * which snapshot-open maps read only so processes opening the same file
+ * share its pages. Fields are in host byte order and sections are 8 byte
+ * aligned, so the values can be read in place. */
+
+#define SNAPSHOT_MAGIC "JMYSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+enum {
+    /* A double per row. */
+    SNAPSHOT_NUMBER,
+    /* A byte per row. */
+    SNAPSHOT_BOOLEAN,
+    /* Row count + 1 offsets into a heap of string bytes. */
+    SNAPSHOT_STRING,
+    /* Offsets into a heap of marshalled values, for times and mixed columns. */
+    SNAPSHOT_MARSHAL
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_fields;
+    uint32_t reserved;
+    uint64_t num_rows;
+} jmy_snapshot_header_t;
+
+typedef struct {
+    /* From the MYSQL_FIELD the column was read with. */
+    uint32_t type;
+    uint32_t flags;
+    uint32_t decimals;
+    uint32_t charsetnr;
+    uint64_t length;
+    uint32_t storage;
+    uint32_t name_length;
+    /* File offsets of the NUL terminated name, the null bitmap, the values
+     * and the heap that string and marshalled values point into. */
+    uint64_t name;
+    uint64_t nulls;
+    uint64_t values;
+    uint64_t heap;
+    uint64_t heap_size;
+} jmy_snapshot_column_t;
+
+typedef struct {
+    const uint8_t *base;
+    size_t size;
+    int num_fields;
+    int64_t num_rows;
+    const jmy_snapshot_column_t *columns;
+} jmy_snapshot_t;
+
+static void __ensure_snapshot_ok(jmy_snapshot_t *snap) {
+    if (snap->base == NULL) {
+        janet_panic("mysql/snapshot is closed");
+    }
+}
+
+static int snapshot_gc(void *p, size_t s) {
+    (void)s;
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)p;
+    if (snap->base != NULL) {
+        munmap((void *)snap->base, snap->size);
+        snap->base = NULL;
+    }
+    return 0;
+}
+
+static void snapshot_to_string(void *p, JanetBuffer *buffer) {
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)p;
+    if (snap->base == NULL) {
+        janet_buffer_push_cstring(buffer, "closed");
+        return;
+    }
+    janet_formatb(buffer, "%d rows, %d columns", (int32_t)snap->num_rows, snap->num_fields);
+}
+
+static const char *snapshot_name(jmy_snapshot_t *snap, int j) {
+    return (const char *)snap->base + snap->columns[j].name;
+}
+
+static Janet snapshot_value(jmy_snapshot_t *snap, int64_t i, int j) {
+    const jmy_snapshot_column_t *c = &snap->columns[j];
+    const uint8_t *nulls = snap->base + c->nulls;
+    if ((nulls[i / 8] >> (i % 8)) & 1) {
+        return janet_wrap_nil();
+    }
+    switch (c->storage) {
+        case SNAPSHOT_NUMBER:
+            return janet_wrap_number(((const double *)(snap->base + c->values))[i]);
+        case SNAPSHOT_BOOLEAN:
+            return janet_wrap_boolean(snap->base[c->values + i]);
+        default: {
+            const uint64_t *offsets = (const uint64_t *)(snap->base + c->values);
+            if (offsets[i] > offsets[i + 1] || offsets[i + 1] > c->heap_size) {
+                janet_panicf("mysql/snapshot value %d of column %s is corrupt", (int32_t)i, snapshot_name(snap, j));
+            }
+            const uint8_t *v = snap->base + c->heap + offsets[i];
+            size_t l = offsets[i + 1] - offsets[i];
+            if (c->storage == SNAPSHOT_STRING) {
+                return janet_stringv(v, (int32_t)l);
+            }
+            return janet_unmarshal(v, l, 0, NULL, NULL);
+        }
+    }
+}
+
+static int snapshot_field_index(jmy_snapshot_t *snap, Janet key) {
+    if (janet_checkint(key)) {
+        int j = janet_unwrap_integer(key);
+        return (j >= 0 && j < snap->num_fields) ? j : -1;
+    }
+    if (!janet_checktypes(key, JANET_TFLAG_STRING | JANET_TFLAG_KEYWORD | JANET_TFLAG_SYMBOL)) {
+        return -1;
+    }
+    const uint8_t *name = janet_unwrap_keyword(key);
+    for (int j = 0; j < snap->num_fields; j++) {
+        if (!janet_cstrcmp(name, snapshot_name(snap, j))) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+static Janet snapshot_row_table(jmy_snapshot_t *snap, int64_t i) {
+    JanetTable *t = janet_table(snap->num_fields);
+    for (int j = 0; j < snap->num_fields; j++) {
+        janet_table_put(t, safe_ckeywordv(snapshot_name(snap, j)), snapshot_value(snap, i, j));
+    }
+    return janet_wrap_table(t);
+}
+
+static Janet snapshot_column(jmy_snapshot_t *snap, int j) {
+    JanetArray *a = janet_array((int32_t)snap->num_rows);
+    for (int64_t i = 0; i < snap->num_rows; i++) {
+        janet_array_push(a, snapshot_value(snap, i, j));
+    }
+    return janet_wrap_array(a);
+}
+
+static int snapshot_get(void *p, Janet key, Janet *out);
+static Janet snapshot_call(void *p, int32_t argc, Janet *argv);
+static Janet snapshot_next(void *p, Janet key);
+static size_t snapshot_length(void *p, size_t size);
+
+static const JanetAbstractType snapshot_type = {
+    "mysql/snapshot",
+    snapshot_gc,
     NULL,
+    snapshot_get,
     NULL,
     NULL,
-    NULL
+    NULL,
+    snapshot_to_string,
+    NULL,
+    NULL,
+    snapshot_next,
+    snapshot_call,
+    snapshot_length
 };
 
 static Janet rows_columns(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_checkabstract(argv[0], &snapshot_type);
+    if (snap != NULL) {
+        __ensure_snapshot_ok(snap);
+        JanetArray *a = janet_array(snap->num_fields);
+        for (int j = 0; j < snap->num_fields; j++) {
+            janet_array_push(a, janet_cstringv(snapshot_name(snap, j)));
+        }
+        return janet_wrap_array(a);
+    }
     jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
     __ensure_rows_ok(rows);
 
@@ -124,7 +644,7 @@ static Janet rows_columns(int32_t argc, Janet *argv) {
     MYSQL_FIELD *mysqlFields = mysql_fetch_fields(rows->r);
     JanetArray *a = janet_array(n);
     for (int i = 0; i < n; i++) {
-        janet_array_push(a, janet_wrap_string(mysqlFields[i].name));
+        janet_array_push(a, janet_cstringv(mysqlFields[i].name));
     }
 
     return janet_wrap_array(a);
@@ -132,6 +652,15 @@ static Janet rows_columns(int32_t argc, Janet *argv) {
 
 static Janet rows_column_types(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_checkabstract(argv[0], &snapshot_type);
+    if (snap != NULL) {
+        __ensure_snapshot_ok(snap);
+        JanetArray *a = janet_array(snap->num_fields);
+        for (int j = 0; j < snap->num_fields; j++) {
+            janet_array_push(a, janet_wrap_number(snap->columns[j].type));
+        }
+        return janet_wrap_array(a);
+    }
     jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
     __ensure_rows_ok(rows);
     int n = mysql_num_fields(rows->r);
@@ -144,10 +673,86 @@ static Janet rows_column_types(int32_t argc, Janet *argv) {
     return janet_wrap_array(a);
 }
 
+/* What a side connection needs to reach the same server. */
+typedef struct {
+    char *host;
+    char *user;
+    char *password;
+    unsigned int port;
+} jmy_credentials_t;
+
+typedef struct {
+    MYSQL *conn;
+    bool in_transaction;
+    /* A lazily begun transaction whose start transaction has not been sent yet. */
+    bool begin_pending;
+    /* The statements beginning the current transaction, each ending in ';'. */
+    char begin_sql[256];
+    /* Set while a thread owns the connection reading prefetched rows. */
+    jmy_prefetch_t *prefetch;
+    /* Set while the connection streams the binlog as a replica. */
+    bool dumping;
+    /* For killing queries from a side connection, see mysql/cancel. */
+    unsigned long thread_id;
+    jmy_credentials_t credentials;
+    /* Bumped by mysql/reset-connection, which closes every statement. */
+    uint32_t resets;
+    /* A hedged select lost on this connection, its result still unread. */
+    bool draining;
+    /* Connected with CLIENT_MULTI_STATEMENTS, so a lazy begin and a commit
+     * can share the round trip of the statement they surround. */
+    bool multi_statements;
+} jmy_context_t;
+
+/* Read and drop every result of the query a lost hedged select left
+ * running, which was killed unless it had already answered. */
+static void context_drain(jmy_context_t *ctx) {
+    ctx->draining = false;
+    if (!mysql_read_query_result(ctx->conn)) {
+        MYSQL_RES *r = mysql_store_result(ctx->conn);
+        if (r != NULL) {
+            mysql_free_result(r);
+        }
+    }
+    while (mysql_next_result(ctx->conn) == 0) {
+        MYSQL_RES *extra = mysql_store_result(ctx->conn);
+        if (extra != NULL) {
+            mysql_free_result(extra);
+        }
+    }
+}
+
+static void __ensure_ctx_ok(jmy_context_t *ctx) {
+    if (ctx->conn == NULL) {
+        janet_panic("mysql/context is disconnected");
+    }
+    if (ctx->prefetch != NULL) {
+        janet_panic("mysql/context is busy prefetching rows");
+    }
+    if (ctx->dumping) {
+        janet_panic("mysql/context is streaming the binlog");
+    }
+    if (ctx->draining) {
+        context_drain(ctx);
+    }
+}
+
 typedef struct {
     MYSQL_STMT *statement;
+    jmy_context_t *ctx;
+    /* Bumped on every execute, which replaces any earlier result. */
+    uint32_t executions;
+    /* The connection's resets when prepared, see stmt-live?. */
+    uint32_t resets;
 } jmy_statement_t;
 
+/* Statement rows read from the statement's own result, which closing or
+ * executing the statement again frees. */
+static bool rows_statement_current(jmy_rows_t *rows) {
+    jmy_statement_t *stmt = (jmy_statement_t *)janet_unwrap_abstract(rows->owner);
+    return stmt->statement == rows->statement && stmt->executions == rows->execution;
+}
+
 static void __ensure_stmt_ok(jmy_statement_t *stmt) {
     if (stmt->statement == NULL) {
         janet_panic("mysql/statement is closed");
@@ -165,6 +770,28 @@ static int statement_gc(void *p, size_t s) {
     return 0;
 }
 
+static int statement_gcmark(void *p, size_t s) {
+    (void)s;
+    jmy_statement_t *stmt = (jmy_statement_t *)p;
+    janet_mark(janet_wrap_abstract(stmt->ctx));
+    return 0;
+}
+
+static Janet stmt_close(int32_t argc, Janet *argv);
+
+static JanetMethod statement_methods[] = {
+    {"close", stmt_close}, /* So statements can be used with 'with' */
+    {NULL, NULL}
+};
+
+static int statement_get(void *ptr, Janet key, Janet *out) {
+    (void)ptr;
+    if (!janet_checktype(key, JANET_KEYWORD)) {
+        return 0;
+    }
+    return janet_getmethod(janet_unwrap_keyword(key), statement_methods, out);
+}
+
 static void statement_to_string(void *p, JanetBuffer *buffer) {
     jmy_statement_t *stmt = (jmy_statement_t *)p;
     (void)stmt;
@@ -175,8 +802,8 @@ static void statement_to_string(void *p, JanetBuffer *buffer) {
 static const JanetAbstractType statement_type = {
     "mysql/statement",
     statement_gc,
-    NULL,
-    NULL,
+    statement_gcmark,
+    statement_get,
     NULL,
     NULL,
     NULL,
@@ -187,28 +814,68 @@ static const JanetAbstractType statement_type = {
     NULL
 };
 
-typedef struct {
-    MYSQL *conn;
-    bool in_transaction;
-} jmy_context_t;
-
-static void __ensure_ctx_ok(jmy_context_t *ctx) {
-    if (ctx->conn == NULL) {
-        janet_panic("mysql/context is disconnected");
-    }
-}
-
 static void context_close_i(jmy_context_t *ctx) {
+    if (ctx->prefetch) {
+        prefetch_release(ctx->prefetch);
+        ctx->prefetch = NULL;
+    }
     if (ctx->conn) {
         mysql_close(ctx->conn);
         ctx->conn = NULL;
     }
 }
 
+/* Consume the results of any statements following the current one,
+ * such as the commit sent by text_query. */
+static void drain_results(MYSQL *conn) {
+    int status;
+    while ((status = mysql_next_result(conn)) == 0) {
+        MYSQL_RES *r = mysql_store_result(conn);
+        if (r != NULL) {
+            mysql_free_result(r);
+        }
+    }
+    if (status > 0) {
+        conn_panic(conn, "mysql_next_result");
+    }
+}
+
+static void begin_i(jmy_context_t *ctx) {
+    ctx->begin_pending = false;
+    if (ctx->multi_statements) {
+        if (mysql_real_query(ctx->conn, ctx->begin_sql, strlen(ctx->begin_sql))) {
+            conn_panic(ctx->conn, "mysql_real_query");
+        }
+        drain_results(ctx->conn);
+    } else {
+        /* Without multi statements each begin statement goes on its own. */
+        for (const char *p = ctx->begin_sql; *p != '\0';) {
+            const char *end = strchr(p, ';');
+            if (mysql_real_query(ctx->conn, p, end - p)) {
+                conn_panic(ctx->conn, "mysql_real_query");
+            }
+            p = end + 1;
+        }
+    }
+    ctx->in_transaction = true;
+}
+
 static int context_gc(void *p, size_t s) {
     (void)s;
     jmy_context_t *ctx = (jmy_context_t *)p;
     context_close_i(ctx);
+    janet_free(ctx->credentials.host);
+    janet_free(ctx->credentials.user);
+    janet_free(ctx->credentials.password);
+    return 0;
+}
+
+static int context_gcmark(void *p, size_t s) {
+    (void)s;
+    jmy_context_t *ctx = (jmy_context_t *)p;
+    if (ctx->prefetch != NULL) {
+        janet_mark(janet_wrap_abstract(ctx->prefetch->rows));
+    }
     return 0;
 }
 
@@ -227,7 +894,7 @@ static int context_get(void *ptr, Janet key, Janet *out) {
 static const JanetAbstractType context_type = {
     "mysql/context",
     context_gc,
-    NULL,
+    context_gcmark,
     context_get,
     NULL,
     NULL,
@@ -239,14 +906,34 @@ static const JanetAbstractType context_type = {
     NULL
 };
 
-static Janet context_connect(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
+static char *copy_cstring(const uint8_t *s) {
+    size_t len = strlen((const char *)s);
+    char *copy = janet_malloc(len + 1);
+    if (copy == NULL) {
+        JANET_OUT_OF_MEMORY;
+    }
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+
+/* Connection parameters unpacked from a mysql/connect config struct. */
+typedef struct {
+    const char *host;
+    const char *user;
+    const char *password;
+    const char *database;
+    unsigned int port;
+    bool multi_statements;
+} jmy_connect_params_t;
+
+static jmy_connect_params_t connect_params(JanetStruct config) {
     // The configuration data is provided as a struct:
     // :host
     // :username
     // :password
     // :database
-    JanetStruct config = janet_getstruct(argv, 0);
+    // :port
+    // :multi-statements
     Janet host = janet_struct_get(config, janet_ckeywordv("host"));
     if (!janet_checktype(host, JANET_STRING)) {
         janet_panicf("host is not a string");
@@ -268,24 +955,64 @@ static Janet context_connect(int32_t argc, Janet *argv) {
     if (!janet_checktype(database, JANET_STRING)) {
         janet_panicf("database is not a string");
     }
+    Janet port = janet_struct_get(config, janet_ckeywordv("port"));
+    if (janet_checktype(port, JANET_NIL)) {
+        port = janet_wrap_integer(0);
+    }
+    if (!janet_checkint(port)) {
+        janet_panicf("port is not an integer");
+    }
 
-    jmy_context_t *ctx = (jmy_context_t *)janet_abstract(&context_type, sizeof(jmy_context_t));
-
-    MYSQL *conn = mysql_init(NULL);
+    jmy_connect_params_t p;
+    p.host = (const char *)janet_unwrap_string(host);
+    p.user = (const char *)janet_unwrap_string(username);
+    p.password = (const char *)janet_unwrap_string(password);
+    p.database = (const char *)janet_unwrap_string(database);
+    p.port = janet_unwrap_integer(port);
+    p.multi_statements = janet_truthy(janet_struct_get(config, janet_ckeywordv("multi-statements")));
+    return p;
+}
 
-    // Unpack connection parameters.
-    if (mysql_real_connect(conn,
-                           (const char *)janet_unwrap_string(host), (const char *)janet_unwrap_string(username),
-                           (const char *)janet_unwrap_string(password), (const char *)janet_unwrap_string(database), 0, NULL, 0) == NULL) {
-        janet_panic("unable to create connection");
-    }
+static bool connect_i(MYSQL *conn, const jmy_connect_params_t *p) {
+    return mysql_real_connect(conn, p->host, p->user, p->password, p->database, p->port, NULL,
+                              p->multi_statements ? CLIENT_MULTI_STATEMENTS : 0) != NULL;
+}
 
+static Janet context_wrap(MYSQL *conn, const jmy_connect_params_t *p) {
+    jmy_context_t *ctx = (jmy_context_t *)janet_abstract(&context_type, sizeof(jmy_context_t));
     ctx->conn = conn;
     ctx->in_transaction = false;
-
+    ctx->begin_pending = false;
+    strcpy(ctx->begin_sql, "start transaction;");
+    ctx->prefetch = NULL;
+    ctx->dumping = false;
+    ctx->thread_id = mysql_thread_id(conn);
+    ctx->credentials.host = copy_cstring((const uint8_t *)p->host);
+    ctx->credentials.user = copy_cstring((const uint8_t *)p->user);
+    ctx->credentials.password = copy_cstring((const uint8_t *)p->password);
+    ctx->credentials.port = p->port;
+    ctx->resets = 0;
+    ctx->draining = false;
+    ctx->multi_statements = p->multi_statements;
     return janet_wrap_abstract(ctx);
 }
 
+static Janet context_connect(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_connect_params_t params = connect_params(janet_getstruct(argv, 0));
+
+    MYSQL *conn = mysql_init(NULL);
+
+    // Unpack connection parameters.
+    if (!connect_i(conn, &params)) {
+        Janet err = make_error("mysql_real_connect", mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn));
+        mysql_close(conn);
+        janet_panicv(err);
+    }
+
+    return context_wrap(conn, &params);
+}
+
 static Janet context_select_db(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
@@ -298,6 +1025,20 @@ static Janet context_select_db(int32_t argc, Janet *argv) {
     return janet_wrap_nil();
 }
 
+static Janet statement_wrap(jmy_context_t *ctx, MYSQL_STMT *statement, size_t len) {
+    jmy_statement_t *result = (jmy_statement_t *)janet_abstract(&statement_type, sizeof(jmy_statement_t));
+    result->statement = statement;
+    result->ctx = ctx;
+    result->executions = 0;
+    result->resets = ctx->resets;
+
+    /* The prepared statement keeps its text, parameter and column metadata. */
+    unsigned long bind_count = mysql_stmt_param_count(statement) + mysql_stmt_field_count(statement);
+    janet_gcpressure(len + bind_count * (sizeof(MYSQL_BIND) + sizeof(MYSQL_FIELD)));
+
+    return janet_wrap_abstract(result);
+}
+
 static Janet context_prepare(int32_t argc, Janet *argv) {
     if (argc < 2) {
         janet_panic("expected at least a pq context and a query string");
@@ -326,10 +1067,230 @@ static Janet context_prepare(int32_t argc, Janet *argv) {
         conn_panic(ctx->conn, "mysql_stmt_prepare");
     }
 
-    jmy_statement_t *result = (jmy_statement_t *)janet_abstract(&statement_type, sizeof(jmy_statement_t));
-    result->statement = statement;
+    return statement_wrap(ctx, statement, len);
+}
 
-    return janet_wrap_abstract(result);
+/* Warm-up opens connections, runs their init statements and prepares
+ * statements with one thread per connection, so a cold start waits for
+ * the slowest connection rather than for all of them in turn. */
+
+typedef struct {
+    const jmy_connect_params_t *params;
+    const char **init;
+    int32_t init_count;
+    const char **queries;
+    int32_t query_count;
+    MYSQL *conn;
+    MYSQL_STMT **statements;
+    double connect_seconds;
+    double init_seconds;
+    double prepare_seconds;
+    /* The failing call, or NULL. The error is copied out of the client
+     * so it can be raised after every thread has finished. */
+    const char *failed;
+    unsigned int code;
+    char sqlstate[6];
+    char message[512];
+} jmy_warm_job_t;
+
+static double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double s = (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+    *start = now;
+    return s;
+}
+
+static void warm_fail(jmy_warm_job_t *job, const char *where, unsigned int code, const char *sqlstate, const char *message) {
+    job->failed = where;
+    job->code = code;
+    snprintf(job->sqlstate, sizeof(job->sqlstate), "%s", sqlstate);
+    snprintf(job->message, sizeof(job->message), "%s", message);
+}
+
+/* Run one init statement, reading every result it produces. */
+static bool warm_init(MYSQL *conn, const char *sql) {
+    if (mysql_real_query(conn, sql, strlen(sql))) {
+        return false;
+    }
+    int status;
+    do {
+        MYSQL_RES *r = mysql_store_result(conn);
+        if (r != NULL) {
+            mysql_free_result(r);
+        } else if (mysql_errno(conn)) {
+            return false;
+        }
+    } while ((status = mysql_next_result(conn)) == 0);
+    return status < 0;
+}
+
+static void *warm_worker(void *p) {
+    jmy_warm_job_t *job = (jmy_warm_job_t *)p;
+    MYSQL *conn = job->conn;
+    mysql_thread_init();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!connect_i(conn, job->params)) {
+        warm_fail(job, "mysql_real_connect", mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn));
+        goto done;
+    }
+    job->connect_seconds = seconds_since(&start);
+
+    for (int32_t i = 0; i < job->init_count; i++) {
+        if (!warm_init(conn, job->init[i])) {
+            warm_fail(job, "mysql_real_query", mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn));
+            goto done;
+        }
+    }
+    job->init_seconds = seconds_since(&start);
+
+    /* Preparing fetches the parameter and column metadata, which the
+     * statement keeps for every later execute. */
+    for (int32_t i = 0; i < job->query_count; i++) {
+        MYSQL_STMT *statement = mysql_stmt_init(conn);
+        if (statement == NULL) {
+            warm_fail(job, "mysql_stmt_init", mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn));
+            goto done;
+        }
+        if (mysql_stmt_prepare(statement, job->queries[i], strlen(job->queries[i]))) {
+            warm_fail(job, "mysql_stmt_prepare", mysql_stmt_errno(statement), mysql_stmt_sqlstate(statement),
+                      mysql_stmt_error(statement));
+            mysql_stmt_close(statement);
+            goto done;
+        }
+        job->statements[i] = statement;
+    }
+    job->prepare_seconds = seconds_since(&start);
+
+done:
+    mysql_thread_end();
+    return NULL;
+}
+
+static const char **warm_strings(JanetView v) {
+    const char **out = janet_smalloc(sizeof(const char *) * (v.len + 1));
+    for (int32_t i = 0; i < v.len; i++) {
+        out[i] = janet_getcstring(v.items, i);
+    }
+    return out;
+}
+
+static Janet context_warm_up(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    jmy_connect_params_t params = connect_params(janet_getstruct(argv, 0));
+    int32_t n = janet_getinteger(argv, 1);
+    if (n < 1) {
+        janet_panic("expected at least one connection");
+    }
+    JanetView init = {NULL, 0};
+    if (argc > 2 && !janet_checktype(argv[2], JANET_NIL)) {
+        init = janet_getindexed(argv, 2);
+    }
+    JanetView queries = {NULL, 0};
+    if (argc > 3 && !janet_checktype(argv[3], JANET_NIL)) {
+        queries = janet_getindexed(argv, 3);
+    }
+    const char **init_sql = warm_strings(init);
+    const char **query_sql = warm_strings(queries);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    jmy_warm_job_t *jobs = janet_smalloc(sizeof(jmy_warm_job_t) * n);
+    pthread_t *tids = janet_smalloc(sizeof(pthread_t) * n);
+    bool *started = janet_smalloc(sizeof(bool) * n);
+    for (int32_t i = 0; i < n; i++) {
+        memset(&jobs[i], 0, sizeof(jmy_warm_job_t));
+        jobs[i].params = &params;
+        jobs[i].init = init_sql;
+        jobs[i].init_count = init.len;
+        jobs[i].queries = query_sql;
+        jobs[i].query_count = queries.len;
+        /* mysql_init sets up the client library, which isn't thread safe
+         * the first time, so it stays on this thread. */
+        jobs[i].conn = mysql_init(NULL);
+        jobs[i].statements = janet_scalloc(queries.len + 1, sizeof(MYSQL_STMT *));
+        if (jobs[i].conn == NULL) {
+            warm_fail(&jobs[i], "mysql_init", CR_OUT_OF_MEMORY, "HY000", "out of memory");
+            started[i] = false;
+            continue;
+        }
+        started[i] = pthread_create(&tids[i], NULL, warm_worker, &jobs[i]) == 0;
+    }
+    /* Connections a thread couldn't take are warmed here, one at a time. */
+    for (int32_t i = 0; i < n; i++) {
+        if (!started[i] && jobs[i].conn != NULL) {
+            warm_worker(&jobs[i]);
+        }
+    }
+    for (int32_t i = 0; i < n; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+    double total = seconds_since(&start);
+
+    Janet err = janet_wrap_nil();
+    for (int32_t i = 0; i < n && janet_checktype(err, JANET_NIL); i++) {
+        if (jobs[i].failed != NULL) {
+            err = make_error(jobs[i].failed, jobs[i].code, jobs[i].sqlstate, jobs[i].message);
+        }
+    }
+
+    /* Each phase reports its slowest connection, which is how long the
+     * phase held up the warm-up. */
+    double connect_seconds = 0, init_seconds = 0, prepare_seconds = 0;
+    JanetArray *conns = janet_array(n);
+    JanetArray *statements = janet_array(n);
+    for (int32_t i = 0; i < n; i++) {
+        jmy_warm_job_t *job = &jobs[i];
+        if (!janet_checktype(err, JANET_NIL)) {
+            for (int32_t j = 0; j < queries.len; j++) {
+                if (job->statements[j] != NULL) {
+                    mysql_stmt_close(job->statements[j]);
+                }
+            }
+            if (job->conn != NULL) {
+                mysql_close(job->conn);
+            }
+        } else {
+            Janet conn = context_wrap(job->conn, &params);
+            jmy_context_t *ctx = (jmy_context_t *)janet_unwrap_abstract(conn);
+            JanetArray *prepared = janet_array(queries.len);
+            for (int32_t j = 0; j < queries.len; j++) {
+                janet_array_push(prepared, statement_wrap(ctx, job->statements[j], strlen(query_sql[j])));
+            }
+            janet_array_push(conns, conn);
+            janet_array_push(statements, janet_wrap_array(prepared));
+        }
+        connect_seconds = job->connect_seconds > connect_seconds ? job->connect_seconds : connect_seconds;
+        init_seconds = job->init_seconds > init_seconds ? job->init_seconds : init_seconds;
+        prepare_seconds = job->prepare_seconds > prepare_seconds ? job->prepare_seconds : prepare_seconds;
+        janet_sfree(job->statements);
+    }
+    janet_sfree(started);
+    janet_sfree(tids);
+    janet_sfree(jobs);
+    janet_sfree(query_sql);
+    janet_sfree(init_sql);
+
+    if (!janet_checktype(err, JANET_NIL)) {
+        janet_panicv(err);
+    }
+
+    JanetKV *timings = janet_struct_begin(4);
+    janet_struct_put(timings, janet_ckeywordv("connect"), janet_wrap_number(connect_seconds));
+    janet_struct_put(timings, janet_ckeywordv("init"), janet_wrap_number(init_seconds));
+    janet_struct_put(timings, janet_ckeywordv("prepare"), janet_wrap_number(prepare_seconds));
+    janet_struct_put(timings, janet_ckeywordv("total"), janet_wrap_number(total));
+
+    JanetKV *st = janet_struct_begin(3);
+    janet_struct_put(st, janet_ckeywordv("conns"), janet_wrap_array(conns));
+    janet_struct_put(st, janet_ckeywordv("statements"), janet_wrap_array(statements));
+    janet_struct_put(st, janet_ckeywordv("timings"), janet_wrap_struct(janet_struct_end(timings)));
+    return janet_wrap_struct(janet_struct_end(st));
 }
 
 typedef struct {
@@ -413,14 +1374,29 @@ static jmy_query_bind_t allocate_binds(int num_fields, MYSQL_FIELD *fields) {
             case MYSQL_TYPE_BLOB:
             case MYSQL_TYPE_VAR_STRING:
             case MYSQL_TYPE_STRING:
-                len = fields[i].max_length;
+            case MYSQL_TYPE_ENUM:
+            case MYSQL_TYPE_SET:
+            case MYSQL_TYPE_GEOMETRY:
+                /* max_length is only known for stored results, larger values
+                 * are refetched by stmt_fetch_row. */
+                len = fields[i].max_length ? fields[i].max_length : 256;
                 break;
 
             default:
                 janet_panicf("unknown field type %d\n", fields[i].type);
         }
 
-        binds[i].buffer_type = fields[i].type;
+        switch (fields[i].type) {
+            case MYSQL_TYPE_ENUM:
+            case MYSQL_TYPE_SET:
+            case MYSQL_TYPE_GEOMETRY:
+                /* Not valid as result buffer types, so read them as bytes. */
+                binds[i].buffer_type = MYSQL_TYPE_BLOB;
+                break;
+            default:
+                binds[i].buffer_type = fields[i].type;
+                break;
+        }
         binds[i].buffer = janet_smalloc(len);
         memset(binds[i].buffer, 0, len);
         binds[i].buffer_length = len;
@@ -432,6 +1408,37 @@ static jmy_query_bind_t allocate_binds(int num_fields, MYSQL_FIELD *fields) {
     return b;
 }
 
+/* Fetch the next row into binds, growing the buffers of columns that
+ * did not fit and fetching them again. Returns false after the last row. */
+static bool stmt_fetch_row(MYSQL_STMT *statement, jmy_query_bind_t *binds) {
+    int status = mysql_stmt_fetch(statement);
+    if (status == MYSQL_NO_DATA) {
+        return false;
+    }
+    if (status == 1) {
+        stmt_panic(statement, "mysql_stmt_fetch");
+    }
+    if (status == MYSQL_DATA_TRUNCATED) {
+        for (int j = 0; j < binds->len; j++) {
+            MYSQL_BIND *bind = &binds->binds[j];
+            if (!*bind->error) {
+                continue;
+            }
+            janet_sfree(bind->buffer);
+            bind->buffer_length = *bind->length;
+            bind->buffer = janet_smalloc(bind->buffer_length);
+            if (mysql_stmt_fetch_column(statement, bind, j, 0)) {
+                stmt_panic(statement, "mysql_stmt_fetch_column");
+            }
+            *bind->error = false;
+        }
+        if (mysql_stmt_bind_result(statement, binds->binds)) {
+            stmt_panic(statement, "mysql_stmt_bind_result");
+        }
+    }
+    return true;
+}
+
 typedef struct {
     MYSQL_BIND *binds;
     unsigned long *lengths;
@@ -540,8 +1547,219 @@ static jmy_exec_bind_t create_exec_bind(int32_t argc, Janet *argv) {
     return b;
 }
 
+/* A statement can't carry the start transaction of a lazy begin, so send it now. */
+static void stmt_ensure_begin(jmy_statement_t *stmt) {
+    __ensure_ctx_ok(stmt->ctx);
+    if (stmt->ctx->begin_pending) {
+        begin_i(stmt->ctx);
+    }
+}
+
+/* Query timeouts. With the :mysql/timeout dynamic binding set, each query
+ * is armed with a deadline on one long-lived watchdog thread, which kills
+ * queries that pass theirs with KILL QUERY from a side connection. Killing
+ * only the running query leaves the connection itself usable. SELECTs
+ * also carry a MAX_EXECUTION_TIME hint, so the server usually stops them
+ * first. */
+
+/* ER_QUERY_TIMEOUT, the server's error for MAX_EXECUTION_TIME. Every
+ * timeout is reported with it. */
+#define JMY_QUERY_TIMEOUT 3024
+
+/* Extra time a hinted select gets before it is killed. */
+#define TIMEOUT_GRACE 0.5
+
+typedef struct jmy_watchdog {
+    struct jmy_watchdog *next;
+    struct timespec deadline;
+    /* Set by the watchdog thread while it kills the query, and after. */
+    bool killing;
+    bool fired;
+    unsigned long thread_id;
+    const jmy_credentials_t *credentials;
+} jmy_watchdog_t;
+
+/* Armed queries, guarded by watchdog_lock. watchdog_wake tells the thread
+ * the list changed, watchdog_killed that a kill finished. */
+static jmy_watchdog_t *watchdog_armed = NULL;
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t watchdog_killed = PTHREAD_COND_INITIALIZER;
+static bool watchdog_started = false;
+
+/* Kill the query running on connection thread_id. Safe off the Janet thread. */
+static bool kill_query(const jmy_credentials_t *c, unsigned long thread_id) {
+    MYSQL *side = mysql_init(NULL);
+    if (side == NULL) {
+        return false;
+    }
+    bool ok = mysql_real_connect(side, c->host, c->user, c->password, NULL, c->port, NULL, 0) != NULL;
+    if (ok) {
+        char sql[64];
+        snprintf(sql, sizeof(sql), "KILL QUERY %lu", thread_id);
+        ok = mysql_query(side, sql) == 0;
+    }
+    mysql_close(side);
+    return ok;
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void *watchdog_worker(void *p) {
+    (void)p;
+    mysql_thread_init();
+    pthread_mutex_lock(&watchdog_lock);
+    for (;;) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        jmy_watchdog_t *due = NULL, *next = NULL;
+        for (jmy_watchdog_t *w = watchdog_armed; w != NULL; w = w->next) {
+            if (w->killing) {
+                continue;
+            }
+            if (!timespec_before(&now, &w->deadline)) {
+                due = w;
+                break;
+            }
+            if (next == NULL || timespec_before(&w->deadline, &next->deadline)) {
+                next = w;
+            }
+        }
+        if (due != NULL) {
+            /* Disarming waits for the kill, so it can't outlive the query
+             * and hit the next one. */
+            due->killing = true;
+            pthread_mutex_unlock(&watchdog_lock);
+            kill_query(due->credentials, due->thread_id);
+            pthread_mutex_lock(&watchdog_lock);
+            due->fired = true;
+            pthread_cond_broadcast(&watchdog_killed);
+        } else if (next != NULL) {
+            /* next may be disarmed while this waits. */
+            struct timespec deadline = next->deadline;
+            pthread_cond_timedwait(&watchdog_wake, &watchdog_lock, &deadline);
+        } else {
+            pthread_cond_wait(&watchdog_wake, &watchdog_lock);
+        }
+    }
+    return NULL;
+}
+
+/* Seconds allowed per query from the :mysql/timeout dynamic binding, or 0. */
+static double query_timeout(void) {
+    Janet t = janet_dyn("mysql/timeout");
+    return janet_checktype(t, JANET_NUMBER) ? janet_unwrap_number(t) : 0;
+}
+
+/* Start watching the next query on ctx, or return NULL without a timeout.
+ * Nothing may panic before the matching watchdog_disarm. */
+static jmy_watchdog_t *watchdog_arm(jmy_context_t *ctx, double seconds) {
+    if (seconds <= 0) {
+        return NULL;
+    }
+    jmy_watchdog_t *w = janet_malloc(sizeof(jmy_watchdog_t));
+    if (w == NULL) {
+        JANET_OUT_OF_MEMORY;
+    }
+    w->killing = false;
+    w->fired = false;
+    w->thread_id = ctx->thread_id;
+    w->credentials = &ctx->credentials;
+    clock_gettime(CLOCK_REALTIME, &w->deadline);
+    double whole = (double)(int64_t)seconds;
+    w->deadline.tv_sec += (time_t)whole;
+    w->deadline.tv_nsec += (long)((seconds - whole) * 1e9);
+    if (w->deadline.tv_nsec >= 1000000000L) {
+        w->deadline.tv_sec++;
+        w->deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&watchdog_lock);
+    if (!watchdog_started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, watchdog_worker, NULL) != 0) {
+            pthread_mutex_unlock(&watchdog_lock);
+            janet_free(w);
+            janet_panic("could not start the query timeout thread");
+        }
+        pthread_detach(thread);
+        watchdog_started = true;
+    }
+    w->next = watchdog_armed;
+    watchdog_armed = w;
+    pthread_cond_signal(&watchdog_wake);
+    pthread_mutex_unlock(&watchdog_lock);
+    return w;
+}
+
+/* Stop watching, returning true if the deadline passed. */
+static bool watchdog_disarm(jmy_watchdog_t *w) {
+    if (w == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&watchdog_lock);
+    while (w->killing && !w->fired) {
+        pthread_cond_wait(&watchdog_killed, &watchdog_lock);
+    }
+    jmy_watchdog_t **link = &watchdog_armed;
+    while (*link != w) {
+        link = &(*link)->next;
+    }
+    *link = w->next;
+    pthread_mutex_unlock(&watchdog_lock);
+    bool fired = w->fired;
+    janet_free(w);
+    return fired;
+}
+
+static Janet timeout_error(double seconds) {
+    char message[128];
+    snprintf(message, sizeof(message), "query exceeded the timeout of %g seconds", seconds);
+    return make_error("timeout", JMY_QUERY_TIMEOUT, "HY000", message);
+}
+
+static void timeout_panic(double seconds) {
+    janet_panicv(timeout_error(seconds));
+}
+
+/* query with a MAX_EXECUTION_TIME hint after its SELECT keyword, in
+ * scratch memory, or NULL if it doesn't start with SELECT. */
+static char *hint_select(const char *query, double seconds) {
+    const char *p = query;
+    while (isspace((unsigned char)*p) || *p == '(') {
+        p++;
+    }
+    if (strncasecmp(p, "select", 6) || isalnum((unsigned char)p[6]) || p[6] == '_') {
+        return NULL;
+    }
+    p += 6;
+    char hint[64];
+    int hint_len = snprintf(hint, sizeof(hint), " /*+ MAX_EXECUTION_TIME(%ld) */",
+                            (long)(seconds * 1000) > 0 ? (long)(seconds * 1000) : 1L);
+    size_t head = p - query;
+    size_t tail = strlen(p);
+    char *hinted = janet_smalloc(head + hint_len + tail + 1);
+    memcpy(hinted, query, head);
+    memcpy(hinted + head, hint, hint_len);
+    memcpy(hinted + head + hint_len, p, tail + 1);
+    return hinted;
+}
+
+static Janet context_cancel(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    if (ctx->conn == NULL) {
+        janet_panic("mysql/context is disconnected");
+    }
+    return janet_wrap_boolean(kill_query(&ctx->credentials, ctx->thread_id));
+}
+
 static Janet stmt_exec(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
     MYSQL_STMT *statement = stmt->statement;
+    stmt_ensure_begin(stmt);
+    stmt->executions++;
     unsigned long param_count = mysql_stmt_param_count(statement);
     if ((unsigned long)argc != param_count) {
         janet_panicf("query: wrong arity %d expected got %d\n", param_count, argc);
@@ -554,7 +1772,13 @@ static Janet stmt_exec(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
         }
     }
 
-    if (mysql_stmt_execute(statement)) {
+    double timeout = query_timeout();
+    jmy_watchdog_t *w = watchdog_arm(stmt->ctx, timeout);
+    bool failed = mysql_stmt_execute(statement) != 0;
+    if (watchdog_disarm(w) && failed) {
+        timeout_panic(timeout);
+    }
+    if (failed) {
         stmt_panic(statement, "mysql_stmt_execute");
     }
     exec_bind_free(binds);
@@ -570,11 +1794,13 @@ static Janet stmt_exec(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
     return janet_wrap_abstract(result);
 }
 
-static Janet stmt_select(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
+static Janet stmt_select(jmy_statement_t *stmt, int32_t argc, Janet *argv, bool buffered) {
     argc -= 1;
     argv += 1;
 
     MYSQL_STMT *statement = stmt->statement;
+    stmt_ensure_begin(stmt);
+    stmt->executions++;
 
     unsigned long param_count = mysql_stmt_param_count(statement);
     if ((unsigned long)argc != param_count) {
@@ -587,8 +1813,27 @@ static Janet stmt_select(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
             stmt_panic(statement, "mysql_stmt_bind_param");
         }
     }
+    if (buffered) {
+        bool truth = 1;
+        if (mysql_stmt_attr_set(statement, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
+            stmt_panic(statement, "mysql_stmt_attr_set");
+        }
+    }
+
+    /* Storing the result is covered by the timeout as well. */
+    double timeout = query_timeout();
+    jmy_watchdog_t *w = watchdog_arm(stmt->ctx, timeout);
+    const char *failed = NULL;
     if (mysql_stmt_execute(statement)) {
-        stmt_panic(statement, "mysql_stmt_execute");
+        failed = "mysql_stmt_execute";
+    } else if (buffered && mysql_stmt_field_count(statement) > 0 && mysql_stmt_store_result(statement)) {
+        failed = "mysql_stmt_store_result";
+    }
+    if (watchdog_disarm(w) && failed != NULL) {
+        timeout_panic(timeout);
+    }
+    if (failed != NULL) {
+        stmt_panic(statement, failed);
     }
     exec_bind_free(binds);
 
@@ -599,15 +1844,6 @@ static Janet stmt_select(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
         janet_panicf("unexpected field_count is %d not zero", num_fields);
     }
 
-    bool truth = 1;
-    if (mysql_stmt_attr_set(statement, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-        stmt_panic(statement, "mysql_stmt_attr_set");
-    }
-
-    if (mysql_stmt_store_result(statement)) {
-        stmt_panic(statement, "mysql_stmt_store_result");
-    }
-
     MYSQL_RES *r = mysql_stmt_result_metadata(statement);
     if (!r) {
         stmt_panic(statement, "mysql_stmt_result_metadata");
@@ -617,6 +1853,13 @@ static Janet stmt_select(jmy_statement_t *stmt, int32_t argc, Janet *argv) {
     rows->statement = statement;
     rows->num_fields = num_fields;
     rows->r = r;
+    rows->buffered = buffered;
+    rows->owner = janet_wrap_abstract(stmt);
+    rows->execution = stmt->executions;
+    rows->prefetch = NULL;
+    rows->decoders = NULL;
+    rows->decoders = resolve_decoders(mysql_fetch_fields(r), num_fields);
+    rows_gcpressure(rows);
 
     return janet_wrap_abstract(rows);
 }
@@ -632,116 +1875,142 @@ static Janet stmt_close(int32_t argc, Janet *argv) {
     return janet_wrap_nil();
 }
 
-static Janet decode_text(char *v, unsigned long l, MYSQL_FIELD *field) {
-    if (v == NULL) {
-        return janet_wrap_nil();
-    }
+/* False once stmt can't be executed: closed, on a closed connection, or
+ * dropped by a reset of its connection. */
+static Janet stmt_live(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_statement_t *stmt = (jmy_statement_t *)janet_getabstract(argv, 0, &statement_type);
+    return janet_wrap_boolean(stmt->statement != NULL && stmt->ctx->conn != NULL &&
+                              stmt->resets == stmt->ctx->resets);
+}
 
-    Janet jv;
+/* Text protocol numbers and times are parsed by these helpers on their
+ * own, so rows-unpack-columns can run them off the Janet thread. */
+static bool text_is_number(MYSQL_FIELD *field) {
     switch (field->type) {
-        case MYSQL_TYPE_NULL:
-            jv = janet_wrap_nil();
-            break;
-
-        case MYSQL_TYPE_TINY: {
-            int i = atoi(v);
-            if (field->length == 1) {
-                jv = janet_wrap_boolean(i != 0);
-            } else {
-                jv = janet_wrap_number(i);
-            }
-            break;
-        }
-
+        case MYSQL_TYPE_TINY:
         case MYSQL_TYPE_SHORT:
-        case MYSQL_TYPE_YEAR: {
-            int i = atoi(v);
-            jv = janet_wrap_number(i);
-            break;
-        }
-
+        case MYSQL_TYPE_YEAR:
         case MYSQL_TYPE_INT24:
-        case MYSQL_TYPE_LONG: {
-            long i = atol(v);
-            jv = janet_wrap_number(i);
-            break;
-        }
-
-        case MYSQL_TYPE_FLOAT: {
-            float i = atol(v);
-            jv = janet_wrap_number(i);
-            break;
-        }
-
-        case MYSQL_TYPE_DOUBLE: {
-            double i = atof(v);
-            jv = janet_wrap_number(i);
-            break;
-        }
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_LONGLONG:
+            return true;
+        default:
+            return false;
+    }
+}
 
+static bool text_is_time(MYSQL_FIELD *field) {
+    switch (field->type) {
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_TIMESTAMP:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP2:
+            return true;
+        default:
+            return false;
+    }
+}
 
-        case MYSQL_TYPE_LONGLONG: {
-            long long int i = atoll(v);
-            jv = janet_wrap_number(i);
-            break;
-        }
+static double text_number(const char *v, MYSQL_FIELD *field) {
+    switch (field->type) {
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+            return atol(v);
+        case MYSQL_TYPE_FLOAT:
+            return (float)atof(v);
+        case MYSQL_TYPE_DOUBLE:
+            return atof(v);
+        case MYSQL_TYPE_LONGLONG:
+            return atoll(v);
+        default:
+            return atoi(v);
+    }
+}
 
-        case MYSQL_TYPE_DATE: {
-            MYSQL_TIME t;
-            memset(&t, 0, sizeof(MYSQL_TIME));
-            sscanf(v, "%d-%d-%d", &t.year, &t.month, &t.day);
+static Janet wrap_text_number(double d, MYSQL_FIELD *field) {
+    if (field->type == MYSQL_TYPE_TINY && field->length == 1) {
+        return janet_wrap_boolean(d != 0);
+    }
+    return janet_wrap_number(d);
+}
 
-            JanetKV *st = janet_struct_begin(3);
-            janet_struct_put(st, janet_ckeywordv("day"), janet_wrap_number(t.day));
-            janet_struct_put(st, janet_ckeywordv("month"), janet_wrap_number(t.month));
-            janet_struct_put(st, janet_ckeywordv("year"), janet_wrap_number(t.year));
-            jv = janet_wrap_struct(janet_struct_end(st));
+static void text_time(const char *v, unsigned long l, MYSQL_FIELD *field, MYSQL_TIME *t) {
+    memset(t, 0, sizeof(MYSQL_TIME));
+    switch (field->type) {
+        case MYSQL_TYPE_DATE:
+            sscanf(v, "%d-%d-%d", &t->year, &t->month, &t->day);
             break;
-        }
-        case MYSQL_TYPE_TIME: {
-            MYSQL_TIME t;
-            memset(&t, 0, sizeof(MYSQL_TIME));
-            sscanf(v, "%d:%d:%d", &t.hour, &t.minute, &t.second);
-
-            JanetKV *st = janet_struct_begin(3);
-            janet_struct_put(st, janet_ckeywordv("seconds"), janet_wrap_number(t.second));
-            janet_struct_put(st, janet_ckeywordv("minutes"), janet_wrap_number(t.minute));
-            janet_struct_put(st, janet_ckeywordv("hours"), janet_wrap_number(t.hour));
-            jv = janet_wrap_struct(janet_struct_end(st));
+        case MYSQL_TYPE_TIME:
+            sscanf(v, "%d:%d:%d", &t->hour, &t->minute, &t->second);
             break;
-        }
-        case MYSQL_TYPE_TIMESTAMP:
-        case MYSQL_TYPE_DATETIME:
-        case MYSQL_TYPE_TIMESTAMP2: {
-            MYSQL_TIME t;
-            memset(&t, 0, sizeof(MYSQL_TIME));
+        default:
             if (l == 19) {
-                sscanf(v, "%d-%d-%d %d:%d:%d", &t.year, &t.month, &t.day, &t.hour, &t.minute, &t.second);
+                sscanf(v, "%d-%d-%d %d:%d:%d", &t->year, &t->month, &t->day, &t->hour, &t->minute, &t->second);
             } else {
-                sscanf(v, "%d-%d-%d %d:%d:%d.%ld", &t.year, &t.month, &t.day, &t.hour, &t.minute, &t.second, &t.second_part);
+                sscanf(v, "%d-%d-%d %d:%d:%d.%ld", &t->year, &t->month, &t->day, &t->hour, &t->minute, &t->second, &t->second_part);
             }
-            int count;
-            if (field->type == MYSQL_TYPE_DATETIME) {
-                count = 8;
-            } else {
-                count = 7;
-            }
-            JanetKV *st = janet_struct_begin(count);
-            janet_struct_put(st, janet_ckeywordv("microseconds"), janet_wrap_number(t.second_part));
-            janet_struct_put(st, janet_ckeywordv("seconds"), janet_wrap_number(t.second));
-            janet_struct_put(st, janet_ckeywordv("minutes"), janet_wrap_number(t.minute));
-            janet_struct_put(st, janet_ckeywordv("hours"), janet_wrap_number(t.hour));
-            janet_struct_put(st, janet_ckeywordv("day"), janet_wrap_number(t.day));
-            janet_struct_put(st, janet_ckeywordv("month"), janet_wrap_number(t.month));
-            janet_struct_put(st, janet_ckeywordv("year"), janet_wrap_number(t.year));
+            break;
+    }
+}
+
+static Janet text_time_struct(MYSQL_TIME *t, MYSQL_FIELD *field) {
+    JanetKV *st;
+    switch (field->type) {
+        case MYSQL_TYPE_DATE:
+            st = janet_struct_begin(3);
+            janet_struct_put(st, janet_ckeywordv("day"), janet_wrap_number(t->day));
+            janet_struct_put(st, janet_ckeywordv("month"), janet_wrap_number(t->month));
+            janet_struct_put(st, janet_ckeywordv("year"), janet_wrap_number(t->year));
+            break;
+        case MYSQL_TYPE_TIME:
+            st = janet_struct_begin(3);
+            janet_struct_put(st, janet_ckeywordv("seconds"), janet_wrap_number(t->second));
+            janet_struct_put(st, janet_ckeywordv("minutes"), janet_wrap_number(t->minute));
+            janet_struct_put(st, janet_ckeywordv("hours"), janet_wrap_number(t->hour));
+            break;
+        default:
+            st = janet_struct_begin(field->type == MYSQL_TYPE_DATETIME ? 8 : 7);
+            janet_struct_put(st, janet_ckeywordv("microseconds"), janet_wrap_number(t->second_part));
+            janet_struct_put(st, janet_ckeywordv("seconds"), janet_wrap_number(t->second));
+            janet_struct_put(st, janet_ckeywordv("minutes"), janet_wrap_number(t->minute));
+            janet_struct_put(st, janet_ckeywordv("hours"), janet_wrap_number(t->hour));
+            janet_struct_put(st, janet_ckeywordv("day"), janet_wrap_number(t->day));
+            janet_struct_put(st, janet_ckeywordv("month"), janet_wrap_number(t->month));
+            janet_struct_put(st, janet_ckeywordv("year"), janet_wrap_number(t->year));
             if (field->type == MYSQL_TYPE_DATETIME) {
-                janet_struct_put(st, janet_ckeywordv("tz"), janet_wrap_number(t.time_zone_displacement));
+                janet_struct_put(st, janet_ckeywordv("tz"), janet_wrap_number(t->time_zone_displacement));
             }
-            jv = janet_wrap_struct(janet_struct_end(st));
             break;
-        }
-        //MYSQL_TYPE_ENUM = 247,
-        //MYSQL_TYPE_SET = 248,
+    }
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static Janet decode_text(char *v, unsigned long l, MYSQL_FIELD *field) {
+    if (v == NULL) {
+        return janet_wrap_nil();
+    }
+    if (text_is_number(field)) {
+        return wrap_text_number(text_number(v, field), field);
+    }
+    if (text_is_time(field)) {
+        MYSQL_TIME t;
+        text_time(v, l, field, &t);
+        return text_time_struct(&t, field);
+    }
+
+    Janet jv;
+    switch (field->type) {
+        case MYSQL_TYPE_NULL:
+            jv = janet_wrap_nil();
+            break;
+
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET:
+        case MYSQL_TYPE_GEOMETRY:
         case MYSQL_TYPE_JSON:
         case MYSQL_TYPE_NEWDECIMAL:
         case MYSQL_TYPE_VARCHAR:
@@ -754,7 +2023,6 @@ static Janet decode_text(char *v, unsigned long l, MYSQL_FIELD *field) {
         case MYSQL_TYPE_STRING:
             jv = janet_wrap_string(janet_string((uint8_t *)v, l));
             break;
-        //MYSQL_TYPE_GEOMETRY = 255
 
         default:
             janet_panicf("unexpected mysql type %d\n", field->type);
@@ -762,23 +2030,57 @@ static Janet decode_text(char *v, unsigned long l, MYSQL_FIELD *field) {
     return jv;
 }
 
+/* True if old is a string holding exactly the l bytes at v, so a table
+ * being refilled can keep it instead of allocating a copy. */
+static bool same_string(Janet old, const char *v, unsigned long l) {
+    if (v == NULL || !janet_checktype(old, JANET_STRING)) {
+        return false;
+    }
+    const uint8_t *str = janet_unwrap_string(old);
+    return (unsigned long)janet_string_length(str) == l && !memcmp(str, v, l);
+}
+
+/* Returns how many columns have a value in t, NULLs being left out. */
+static int text_row_fill(JanetTable *t, MYSQL_ROW row, unsigned long *lengths, int num_fields, MYSQL_FIELD *fields,
+                         const jmy_decoder_t *decoders) {
+    int present = 0;
+    for (int j = 0; j < num_fields; j++) {
+        Janet k = safe_ckeywordv(fields[j].name);
+        /* A function's result may equal some other value's text. */
+        if (t->count > 0 && janet_checktype(decoders[j].fn, JANET_NIL) &&
+                same_string(janet_table_get(t, k), row[j], lengths[j])) {
+            present++;
+            continue;
+        }
+        Janet v = decode_text_with(&decoders[j], row[j], lengths[j], &fields[j]);
+        present += !janet_checktype(v, JANET_NIL);
+        janet_table_put(t, k, v);
+    }
+    return present;
+}
+
+static Janet text_row_table(MYSQL_ROW row, unsigned long *lengths, int num_fields, MYSQL_FIELD *fields,
+                            const jmy_decoder_t *decoders) {
+    JanetTable *t = janet_table(num_fields);
+    text_row_fill(t, row, lengths, num_fields, fields, decoders);
+    return janet_wrap_table(t);
+}
+
 static Janet rows_text_unpack(jmy_rows_t *rows) {
     int n = mysql_num_rows(rows->r);
     int num_fields = mysql_num_fields(rows->r);
 
     MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
 
+    /* n is 0 for unbuffered rows, which are read until the end. */
+    if (rows->buffered) {
+        mysql_data_seek(rows->r, 0);
+    }
     JanetArray *a = janet_array(n);
-    for (int i = 0; i < n; i++) {
-        JanetTable *t = janet_table(num_fields);
-        MYSQL_ROW row = mysql_fetch_row(rows->r);
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(rows->r)) != NULL) {
         unsigned long *lengths = mysql_fetch_lengths(rows->r);
-        for (int j = 0; j < num_fields; j++) {
-            Janet jv = decode_text(row[j], lengths[j], &fields[j]);
-            Janet k = safe_ckeywordv(fields[j].name);
-            janet_table_put(t, k, jv);
-        }
-        janet_array_push(a, janet_wrap_table(t));
+        janet_array_push(a, text_row_table(row, lengths, num_fields, fields, rows->decoders));
     }
 
     return janet_wrap_array(a);
@@ -903,290 +2205,2668 @@ static Janet decode_binary(MYSQL_BIND *bind, MYSQL_FIELD *field) {
             break;
 
         default:
-            //MYSQL_TYPE_ENUM = 247,
-            //MYSQL_TYPE_SET = 248,
-            //MYSQL_TYPE_GEOMETRY = 255
             janet_panicf("unexpected mysql type %d\n", t);
     }
     return jv;
 }
 
+/* Column decoders. The *decoders* table maps column names, as strings, or type
+ * keywords such as :datetime to a representation. A result looks each
+ * column up once when it is created, so decoding a cell is one call
+ * through its jmy_decoder_t. */
 
-static Janet rows_binary_unpack(jmy_rows_t *rows) {
-    int num_fields = rows->num_fields;
-    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+static JANET_THREAD_LOCAL JanetTable *decoders_registry;
 
-    jmy_query_bind_t binds = allocate_binds(num_fields, fields);
-    if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
-        stmt_panic(rows->statement, "mysql_stmt_bind_result");
-    }
+static int binary_text(MYSQL_BIND *bind, MYSQL_FIELD *field, char *buf, size_t size);
 
-    JanetArray *a = janet_array(0);
-    while (1) {
-        int status = mysql_stmt_fetch(rows->statement);
-        if (status == 1 || status == MYSQL_NO_DATA) {
-            break;
-        }
-        if (status == MYSQL_DATA_TRUNCATED) {
-            janet_panicf("mysql_stmt_fetch failed: MYSQL_DATA_TRUNCATED\n");
-        }
+static Janet text_default(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    return decode_text(v, l, field);
+}
 
-        JanetTable *t = janet_table(num_fields);
-        for (int j = 0; j < num_fields; ++j) {
-            if (*binds.binds[j].error) {
-                janet_panicf("unexpected error in field %d", j);
-            }
-            Janet jv = decode_binary(&binds.binds[j], &fields[j]);
-            Janet k = safe_ckeywordv(fields[j].name);
-            janet_table_put(t, k, jv);
-        }
+static Janet text_default_number(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)l;
+    (void)fn;
+    return wrap_text_number(text_number(v, field), field);
+}
 
-        janet_array_push(a, janet_wrap_table(t));
-    }
+static Janet text_default_time(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    MYSQL_TIME t;
+    text_time(v, l, field, &t);
+    return text_time_struct(&t, field);
+}
 
-    mysql_free_result(rows->r);
-    rows->r = NULL;
+static Janet binary_default(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    return decode_binary(bind, field);
+}
 
-    query_bind_free(binds);
+static Janet text_raw(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)field;
+    (void)fn;
+    return janet_stringv((const uint8_t *)v, (int32_t)l);
+}
 
-    return janet_wrap_array(a);
+static Janet binary_raw(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    char buf[64];
+    int n = binary_text(bind, field, buf, sizeof(buf));
+    if (n < 0) {
+        return janet_stringv((const uint8_t *)bind->buffer, (int32_t)*bind->length);
+    }
+    return janet_stringv((const uint8_t *)buf, n);
 }
 
-static Janet rows_unpack(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
-    __ensure_rows_ok(rows);
+/* Days from 1970-01-01 to a date in the proleptic Gregorian calendar. */
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
 
-    if (rows->statement == NULL) {
-        return rows_text_unpack(rows);
-    } else {
-        return rows_binary_unpack(rows);
+/* Seconds since the epoch for dates and datetimes, taken as UTC, or the
+ * signed length of a TIME. Zero dates are nil. */
+static Janet time_epoch(MYSQL_TIME *t) {
+    double seconds = t->hour * 3600.0 + t->minute * 60.0 + t->second + t->second_part / 1e6;
+    if (t->time_type == MYSQL_TIMESTAMP_TIME) {
+        return janet_wrap_number(t->neg ? -seconds : seconds);
+    }
+    if (t->month == 0 || t->day == 0) {
+        return janet_wrap_nil();
     }
+    return janet_wrap_number((double)days_from_civil(t->year, t->month, t->day) * 86400.0 + seconds);
 }
 
-static int count_subs(const char *q) {
-    int count = 0;
-    while (*q != '\0') {
-        if (*q == '?') {
-            count++;
+static Janet text_epoch(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    MYSQL_TIME t;
+    text_time(v, l, field, &t);
+    if (field->type == MYSQL_TYPE_TIME) {
+        t.time_type = MYSQL_TIMESTAMP_TIME;
+        if (v[0] == '-') {
+            t.neg = true;
+            t.hour = (unsigned int)(-(int)t.hour);
         }
-        q++;
     }
-    return count;
+    return time_epoch(&t);
 }
 
-static char *interpolate_params(MYSQL *conn, const char *q, size_t len, int32_t argc, Janet *argv) {
-    int n_subs = count_subs(q);
-    char **pvals = janet_smalloc(n_subs * sizeof(char *));
-    int *plengths = janet_smalloc(n_subs * sizeof(int));
-    if (n_subs != argc) {
-        janet_panicf("query: wrong arity %d expected got %d\n", n_subs, argc);
-    }
-
-    for (int i = 0; i < argc; i++) {
-        Janet j = argv[i];
-
-        switch (janet_type(j)) {
-            case JANET_NIL: {
-                const char *null = "NULL";
-                size_t len = strlen(null);
-                pvals[i] = janet_smalloc(len + 1);
-                strcpy(pvals[i], null);
-                plengths[i] = len;
-                break;
-            }
-
-            case JANET_BOOLEAN: {
-                pvals[i] = janet_smalloc(2);
-                plengths[i] = 1;
-                if (janet_unwrap_boolean(j)) {
-                    pvals[i][0] = '1';
-                } else {
-                    pvals[i][0] = '0';
-                }
-                pvals[i][1] = '\0';
-                break;
-            }
-
-            case JANET_BUFFER: {
-                JanetBuffer *b = janet_unwrap_buffer(j);
-                pvals[i] = janet_smalloc(b->count);
-                memcpy(pvals[i], b->data, b->count);
-                plengths[i] = b->count;
-                break;
-            }
-
-            case JANET_KEYWORD:
-            case JANET_STRING: {
-                const char *s = (char *)janet_unwrap_string(j);
-                size_t l = janet_string_length(s);
-                pvals[i] = janet_smalloc(l * 2 + 2 + 1);
-                pvals[i][0] = '\'';
-                unsigned long ol = mysql_real_escape_string_quote(conn, pvals[i] + 1, s, l, '\'');
-                pvals[i][1 + ol] = '\'';
-                plengths[i] = ol + 2;
-                break;
-            }
-
-            case JANET_NUMBER: {
-                double d = janet_unwrap_number(j);
-                /* The exact range could be increased to ~52 bits afaik, for now 32 bits
-                * only. */
-                const char *fmt = (d == floor(d) && d <= ((double)INT32_MAX) &&
-                                   d >= ((double)INT32_MIN))
-                                  ? "%.0f"
-                                  : "%g";
-                size_t l = snprintf(NULL, 0, fmt, d);
-                pvals[i] = janet_smalloc(l + 1);
-                snprintf(pvals[i], l + 1, fmt, d);
-                plengths[i] = l;
-                break;
-            }
-
-            case JANET_ABSTRACT: {
-                JanetIntType intt = janet_is_int(j);
-                if (intt == JANET_INT_S64) {
-                    int64_t v = janet_unwrap_s64(j);
-                    size_t l = snprintf(NULL, 0, "%" PRId64, v);
-                    pvals[i] = janet_smalloc(l + 1);
-                    snprintf(pvals[i], l + 1, "%" PRId64, v);
-                    plengths[i] = l;
-                    break;
-                } else if (intt == JANET_INT_U64) {
-                    uint64_t v = janet_unwrap_u64(j);
-                    size_t l = snprintf(NULL, 0, "%" PRIu64, v);
-                    pvals[i] = janet_smalloc(l + 1);
-                    snprintf(pvals[i], l + 1, "%" PRIu64, v);
-                    plengths[i] = l;
-                    break;
-                } else {
-                    /* fall-thru */
-                }
-            }
-            /* fall-thru */
+static Janet binary_epoch(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn) {
+    (void)field;
+    (void)fn;
+    return time_epoch((MYSQL_TIME *)bind->buffer);
+}
 
-            default:
-                janet_panicf("cannot encode janet type %d", janet_type(j));
-        }
+static int64_t decimal_digit(int64_t x, int digit, MYSQL_FIELD *field) {
+    if (x > (INT64_MAX - digit) / 10) {
+        janet_panicf("decimal in column %s is too large for :fixed", field->name);
     }
+    return x * 10 + digit;
+}
 
-    int total = 0;
-    for (int i = 0; i < argc; i++) {
-        total += plengths[i];
+/* A DECIMAL as an int/s64 counting units of its last decimal place. */
+static Janet decimal_fixed(const char *v, unsigned long l, MYSQL_FIELD *field) {
+    unsigned long i = 0;
+    bool negative = l > 0 && v[0] == '-';
+    if (negative) {
+        i++;
     }
-    char *query = janet_smalloc(len + total + 1);
-    char *ps = query;
-    const char *pq = q;
-    int pi = 0;
-    while (*pq != '\0') {
-        if (*pq == '?') {
-            memcpy(ps, pvals[pi], plengths[pi]);
-            ps += plengths[pi];
-            pi++;
-        } else {
-            *ps++ = *pq;
+    int64_t x = 0;
+    int places = -1;
+    for (; i < l; i++) {
+        if (v[i] == '.') {
+            places = 0;
+            continue;
+        }
+        x = decimal_digit(x, v[i] - '0', field);
+        if (places >= 0) {
+            places++;
         }
-        pq++;
     }
-
-    *ps = '\0';
-
-    /* Free in reverse order for sfree's sake */
-    for (int i = argc - 1; i > 0; i--) {
-        janet_sfree(pvals[i]);
+    for (places = places < 0 ? 0 : places; places < (int)field->decimals; places++) {
+        x = decimal_digit(x, 0, field);
     }
-    janet_sfree(pvals);
-    janet_sfree(plengths);
-
-    return query;
+    return janet_wrap_s64(negative ? -x : x);
 }
 
-static Janet text_exec(jmy_context_t *ctx, int32_t argc, Janet *argv) {
-    const char *q = janet_getcstring(argv, 0);
-    int len = strlen(q);
+static Janet text_fixed(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    return decimal_fixed(v, l, field);
+}
 
-    argc -= 1;
-    argv += 1;
+static Janet binary_fixed(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn) {
+    (void)fn;
+    return decimal_fixed(bind->buffer, *bind->length, field);
+}
 
-    char *query = interpolate_params(ctx->conn, q, len, argc, argv);
-    if (mysql_real_query(ctx->conn, query, strlen(query))) {
-        janet_panicf("mysql_real_query failed: %s\n", mysql_error(ctx->conn));
+static Janet decimal_number(const char *v, unsigned long l) {
+    /* DECIMAL has at most 65 digits. */
+    char buf[80];
+    if (l >= sizeof(buf)) {
+        l = sizeof(buf) - 1;
     }
+    memcpy(buf, v, l);
+    buf[l] = '\0';
+    return janet_wrap_number(strtod(buf, NULL));
+}
 
-    janet_sfree(query);
+static Janet text_decimal_number(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    (void)field;
+    (void)fn;
+    return decimal_number(v, l);
+}
 
-    /* the column count is > 0 if there is a result set */
-    /* 0 if the result is only the final status packet */
-    int num_fields = mysql_field_count(ctx->conn);
-    if (num_fields > 0) {
-        janet_panicf("mysql_field_count unexpected returned 0\n");
-    }
+static Janet binary_decimal_number(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn) {
+    (void)field;
+    (void)fn;
+    return decimal_number(bind->buffer, *bind->length);
+}
 
-    jmy_result_t *result = (jmy_result_t *)janet_abstract(&result_type, sizeof(jmy_result_t));
-    result->affected_rows = mysql_affected_rows(ctx->conn);
-    result->insert_id = mysql_insert_id(ctx->conn);
-    return janet_wrap_abstract(result);
+static Janet call_decoder(Janet fn, Janet raw) {
+    Janet out;
+    /* Decoding holds scratch memory, which a collection would free. */
+    int handle = janet_gclock();
+    JanetSignal sig = janet_pcall(janet_unwrap_function(fn), 1, &raw, &out, NULL);
+    janet_gcunlock(handle);
+    if (sig != JANET_SIGNAL_OK) {
+        janet_panicv(out);
+    }
+    return out;
 }
 
-static Janet text_select(jmy_context_t *ctx, int32_t argc, Janet *argv) {
-    const char *q = janet_getcstring(argv, 1);
-    int len = strlen(q);
+static Janet text_function(char *v, unsigned long l, MYSQL_FIELD *field, Janet fn) {
+    return call_decoder(fn, text_raw(v, l, field, fn));
+}
 
-    argc -= 2;
-    argv += 2;
+static Janet binary_function(MYSQL_BIND *bind, MYSQL_FIELD *field, Janet fn) {
+    return call_decoder(fn, binary_raw(bind, field, fn));
+}
 
-    char *query = interpolate_params(ctx->conn, q, len, argc, argv);
-    if (mysql_real_query(ctx->conn, query, strlen(query))) {
-        janet_panicf("mysql_real_query failed: %s\n", mysql_error(ctx->conn));
+/* The keyword a column's type is registered under in *decoders*. */
+static const char *field_type_name(MYSQL_FIELD *field) {
+    if (field->flags & ENUM_FLAG) {
+        return "enum";
     }
-    janet_sfree(query);
-
-    int num_fields = mysql_field_count(ctx->conn);
-    if (num_fields == 0) {
-        janet_panicf("mysql_field_count unexpected returned 0\n");
+    if (field->flags & SET_FLAG) {
+        return "set";
     }
-
-    MYSQL_RES *r = mysql_store_result(ctx->conn);
-    if (r == NULL) {
-        janet_panicf("mysql_store_result failed: %s\n", mysql_error(ctx->conn));
+    switch (field->type) {
+        case MYSQL_TYPE_TINY:
+            return "tiny";
+        case MYSQL_TYPE_SHORT:
+            return "short";
+        case MYSQL_TYPE_INT24:
+            return "int24";
+        case MYSQL_TYPE_LONG:
+            return "long";
+        case MYSQL_TYPE_LONGLONG:
+            return "longlong";
+        case MYSQL_TYPE_FLOAT:
+            return "float";
+        case MYSQL_TYPE_DOUBLE:
+            return "double";
+        case MYSQL_TYPE_YEAR:
+            return "year";
+        case MYSQL_TYPE_DECIMAL:
+        case MYSQL_TYPE_NEWDECIMAL:
+            return "decimal";
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_NEWDATE:
+            return "date";
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_TIME2:
+            return "time";
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_DATETIME2:
+            return "datetime";
+        case MYSQL_TYPE_TIMESTAMP:
+        case MYSQL_TYPE_TIMESTAMP2:
+            return "timestamp";
+        case MYSQL_TYPE_BIT:
+            return "bit";
+        case MYSQL_TYPE_JSON:
+            return "json";
+        case MYSQL_TYPE_GEOMETRY:
+            return "geometry";
+        case MYSQL_TYPE_ENUM:
+            return "enum";
+        case MYSQL_TYPE_SET:
+            return "set";
+        case MYSQL_TYPE_TINY_BLOB:
+        case MYSQL_TYPE_MEDIUM_BLOB:
+        case MYSQL_TYPE_LONG_BLOB:
+        case MYSQL_TYPE_BLOB:
+            /* TEXT columns are blobs with a character set. */
+            return field->charsetnr == 63 ? "blob" : "text";
+        case MYSQL_TYPE_VARCHAR:
+        case MYSQL_TYPE_VAR_STRING:
+            return "varchar";
+        case MYSQL_TYPE_STRING:
+            return "char";
+        default:
+            return "null";
     }
+}
 
-    jmy_rows_t *rows = (jmy_rows_t *)janet_abstract(&rows_type, sizeof(jmy_rows_t));
-    rows->num_fields = num_fields;
-    rows->r = r;
-    rows->statement = NULL;
-
-    return janet_wrap_abstract(rows);
+static bool field_is_decimal(MYSQL_FIELD *field) {
+    return field->type == MYSQL_TYPE_NEWDECIMAL || field->type == MYSQL_TYPE_DECIMAL;
 }
 
-static Janet context_exec(int32_t argc, Janet *argv) {
-    if (argc < 2) {
-        janet_panic("expected at least a pq context and a query string");
-    }
-    if (argc > 10000000) {
-        janet_panic("too many arguments");
+/* Set d to decode field as rep, returning false if rep doesn't apply. */
+static bool resolve_decoder(jmy_decoder_t *d, MYSQL_FIELD *field, Janet rep) {
+    d->fn = janet_wrap_nil();
+    d->binary = binary_default;
+    if (text_is_number(field)) {
+        d->text = text_default_number;
+    } else if (text_is_time(field)) {
+        d->text = text_default_time;
+    } else {
+        d->text = text_default;
     }
 
-    if (janet_checkabstract(argv[0], &context_type)) {
-        jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
-        __ensure_ctx_ok(ctx);
-        argc -= 1;
-        argv += 1;
-        return text_exec(ctx, argc, argv);
+    if (janet_checktype(rep, JANET_NIL)) {
+        return true;
     }
-
-    if (janet_checkabstract(argv[0], &statement_type)) {
-        jmy_statement_t *stmt = (jmy_statement_t *)janet_getabstract(argv, 0, &statement_type);
-        __ensure_stmt_ok(stmt);
-        argc -= 1;
-        argv += 1;
-        return stmt_exec(stmt, argc, argv);
+    if (janet_checktype(rep, JANET_FUNCTION)) {
+        d->text = text_function;
+        d->binary = binary_function;
+        d->fn = rep;
+        return true;
+    }
+    if (!janet_checktype(rep, JANET_KEYWORD)) {
+        return false;
+    }
+    const uint8_t *kind = janet_unwrap_keyword(rep);
+    if (!janet_cstrcmp(kind, "default")) {
+        return true;
+    }
+    if (!janet_cstrcmp(kind, "raw")) {
+        d->text = text_raw;
+        d->binary = binary_raw;
+        return true;
+    }
+    if (!janet_cstrcmp(kind, "epoch") && text_is_time(field)) {
+        d->text = text_epoch;
+        d->binary = binary_epoch;
+        return true;
+    }
+    if (!janet_cstrcmp(kind, "fixed") && field_is_decimal(field)) {
+        d->text = text_fixed;
+        d->binary = binary_fixed;
+        return true;
+    }
+    if (!janet_cstrcmp(kind, "number") && field_is_decimal(field)) {
+        d->text = text_decimal_number;
+        d->binary = binary_decimal_number;
+        return true;
+    }
+    return false;
+}
+
+/* The decoders for a result's columns from the :mysql/decoders dynamic
+ * binding or else *decoders*, with column names taking precedence
+ * over types. Freed with janet_free. */
+static jmy_decoder_t *resolve_decoders(MYSQL_FIELD *fields, int num_fields) {
+    Janet dyn = janet_dyn("mysql/decoders");
+    JanetTable *registry = janet_checktype(dyn, JANET_TABLE) ? janet_unwrap_table(dyn) : decoders_registry;
+    bool empty = registry == NULL || registry->count == 0;
+
+    jmy_decoder_t *decoders = janet_malloc(sizeof(jmy_decoder_t) * (num_fields > 0 ? num_fields : 1));
+    if (decoders == NULL) {
+        JANET_OUT_OF_MEMORY;
+    }
+    for (int j = 0; j < num_fields; j++) {
+        Janet rep = janet_wrap_nil();
+        if (!empty) {
+            rep = janet_table_get(registry, janet_cstringv(fields[j].name));
+            if (janet_checktype(rep, JANET_NIL)) {
+                rep = janet_table_get(registry, janet_ckeywordv(field_type_name(&fields[j])));
+            }
+        }
+        if (!resolve_decoder(&decoders[j], &fields[j], rep)) {
+            janet_free(decoders);
+            janet_panicf("decoder %v does not apply to column %s", rep, fields[j].name);
+        }
+    }
+    return decoders;
+}
+
+/* Returns how many columns have a value in t, see text_row_fill. */
+static int binary_row_fill(JanetTable *t, jmy_query_bind_t *binds, int num_fields, MYSQL_FIELD *fields,
+                           const jmy_decoder_t *decoders) {
+    int present = 0;
+    for (int j = 0; j < num_fields; ++j) {
+        MYSQL_BIND *bind = &binds->binds[j];
+        if (*bind->error) {
+            janet_panicf("unexpected error in field %d", j);
+        }
+        Janet k = safe_ckeywordv(fields[j].name);
+        if (t->count > 0 && !*bind->is_null && janet_checktype(decoders[j].fn, JANET_NIL) &&
+                same_string(janet_table_get(t, k), bind->buffer, *bind->length)) {
+            present++;
+            continue;
+        }
+        Janet v = decode_binary_with(&decoders[j], bind, &fields[j]);
+        present += !janet_checktype(v, JANET_NIL);
+        janet_table_put(t, k, v);
+    }
+    return present;
+}
+
+static Janet binary_row_table(jmy_query_bind_t *binds, int num_fields, MYSQL_FIELD *fields,
+                              const jmy_decoder_t *decoders) {
+    JanetTable *t = janet_table(num_fields);
+    binary_row_fill(t, binds, num_fields, fields, decoders);
+    return janet_wrap_table(t);
+}
+
+static Janet rows_binary_unpack(jmy_rows_t *rows) {
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+
+    jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+    if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+        stmt_panic(rows->statement, "mysql_stmt_bind_result");
+    }
+    if (rows->buffered) {
+        mysql_stmt_data_seek(rows->statement, 0);
+    }
+
+    JanetArray *a = janet_array(0);
+    while (stmt_fetch_row(rows->statement, &binds)) {
+        janet_array_push(a, binary_row_table(&binds, num_fields, fields, rows->decoders));
+    }
+
+    query_bind_free(binds);
+
+    return janet_wrap_array(a);
+}
+
+/* Random access into buffered rows. Row i is decoded only when it is read,
+ * either whole with (rows i) or one cell at a time through a mysql/row view. */
+
+/* A lazy view of row index of either rows or a snapshot. */
+typedef struct {
+    jmy_rows_t *rows;
+    jmy_snapshot_t *snapshot;
+    int64_t index;
+} jmy_row_t;
+
+static int64_t rows_index(jmy_rows_t *rows, Janet key) {
+    __ensure_rows_ok(rows);
+    if (!rows->buffered) {
+        janet_panic("mysql/rows are not buffered");
+    }
+    int64_t n = rows_count(rows);
+    if (!janet_checkint64(key)) {
+        janet_panicf("expected integer row index, got %v", key);
+    }
+    int64_t i = (int64_t)janet_unwrap_number(key);
+    if (i < 0 || i >= n) {
+        janet_panicf("row index %v out of range [0,%d)", key, (int32_t)n);
+    }
+    return i;
+}
+
+static int rows_field_index(jmy_rows_t *rows, Janet key) {
+    if (janet_checkint(key)) {
+        int j = janet_unwrap_integer(key);
+        return (j >= 0 && j < rows->num_fields) ? j : -1;
+    }
+    /* Buffers aren't NUL terminated, so can't be compared as names. */
+    if (!janet_checktypes(key, JANET_TFLAG_STRING | JANET_TFLAG_KEYWORD | JANET_TFLAG_SYMBOL)) {
+        return -1;
+    }
+    const uint8_t *name = janet_unwrap_keyword(key);
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    for (int j = 0; j < rows->num_fields; j++) {
+        if (!janet_cstrcmp(name, fields[j].name)) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+/* Decode row i, or only column `only` when it is not negative. */
+static Janet rows_decode_at(jmy_rows_t *rows, int64_t i, int only) {
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+
+    if (rows->statement == NULL) {
+        mysql_data_seek(rows->r, (uint64_t)i);
+        MYSQL_ROW row = mysql_fetch_row(rows->r);
+        if (row == NULL) {
+            janet_panicf("row %d is missing", (int32_t)i);
+        }
+        unsigned long *lengths = mysql_fetch_lengths(rows->r);
+        if (only >= 0) {
+            return decode_text_with(&rows->decoders[only], row[only], lengths[only], &fields[only]);
+        }
+        return text_row_table(row, lengths, num_fields, fields, rows->decoders);
+    }
+
+    jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+    if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+        stmt_panic(rows->statement, "mysql_stmt_bind_result");
+    }
+    mysql_stmt_data_seek(rows->statement, (uint64_t)i);
+    if (!stmt_fetch_row(rows->statement, &binds)) {
+        janet_panicf("row %d is missing", (int32_t)i);
+    }
+    Janet result;
+    if (only >= 0) {
+        result = decode_binary_with(&rows->decoders[only], &binds.binds[only], &fields[only]);
+    } else {
+        result = binary_row_table(&binds, num_fields, fields, rows->decoders);
+    }
+    query_bind_free(binds);
+    return result;
+}
+
+static int row_gcmark(void *p, size_t s) {
+    (void)s;
+    jmy_row_t *row = (jmy_row_t *)p;
+    janet_mark(janet_wrap_abstract(row->rows != NULL ? (void *)row->rows : (void *)row->snapshot));
+    return 0;
+}
+
+static int row_get(void *p, Janet key, Janet *out) {
+    jmy_row_t *row = (jmy_row_t *)p;
+    if (row->snapshot != NULL) {
+        __ensure_snapshot_ok(row->snapshot);
+        int j = snapshot_field_index(row->snapshot, key);
+        if (j < 0) {
+            return 0;
+        }
+        *out = snapshot_value(row->snapshot, row->index, j);
+        return 1;
+    }
+    __ensure_rows_ok(row->rows);
+    int j = rows_field_index(row->rows, key);
+    if (j < 0) {
+        return 0;
+    }
+    *out = rows_decode_at(row->rows, row->index, j);
+    return 1;
+}
+
+static Janet row_next(void *p, Janet key) {
+    jmy_row_t *row = (jmy_row_t *)p;
+    jmy_snapshot_t *snap = row->snapshot;
+    if (snap != NULL) {
+        __ensure_snapshot_ok(snap);
+    } else {
+        __ensure_rows_ok(row->rows);
+    }
+    int j = 0;
+    if (!janet_checktype(key, JANET_NIL)) {
+        j = (snap != NULL ? snapshot_field_index(snap, key) : rows_field_index(row->rows, key)) + 1;
+        if (j <= 0) {
+            return janet_wrap_nil();
+        }
+    }
+    if (snap != NULL) {
+        return j < snap->num_fields ? safe_ckeywordv(snapshot_name(snap, j)) : janet_wrap_nil();
+    }
+    MYSQL_FIELD *fields = mysql_fetch_fields(row->rows->r);
+    return j < row->rows->num_fields ? safe_ckeywordv(fields[j].name) : janet_wrap_nil();
+}
+
+static void row_to_string(void *p, JanetBuffer *buffer) {
+    jmy_row_t *row = (jmy_row_t *)p;
+    janet_formatb(buffer, "row %d", (int32_t)row->index);
+}
+
+static Janet row_call(void *p, int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    Janet out;
+    if (!row_get(p, argv[0], &out)) {
+        janet_panicf("no column %v", argv[0]);
+    }
+    return out;
+}
+
+static const JanetAbstractType row_type = {
+    "mysql/row",
+    NULL,
+    row_gcmark,
+    row_get,
+    NULL,
+    NULL,
+    NULL,
+    row_to_string,
+    NULL,
+    NULL,
+    row_next,
+    row_call,
+    NULL
+};
+
+/* Hand the connection back once the reader thread is finished with it. */
+static void rows_prefetch_done(jmy_rows_t *rows) {
+    jmy_context_t *ctx = (jmy_context_t *)janet_unwrap_abstract(rows->owner);
+    if (ctx->prefetch == rows->prefetch) {
+        ctx->prefetch = NULL;
+        prefetch_release(rows->prefetch);
+    }
+}
+
+static Janet rows_prefetch(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    int depth = janet_optinteger(argv, argc, 1, 4);
+    int batch_rows = janet_optinteger(argv, argc, 2, 1024);
+    __ensure_rows_ok(rows);
+    if (rows->statement != NULL || rows->buffered) {
+        janet_panic("only rows from mysql/select-unbuffered on a connection can be prefetched");
+    }
+    if (depth < 1 || batch_rows < 1) {
+        janet_panic("expected a positive queue depth and batch size");
+    }
+    jmy_context_t *ctx = (jmy_context_t *)janet_unwrap_abstract(rows->owner);
+    __ensure_ctx_ok(ctx);
+
+    jmy_prefetch_t *p = calloc(1, sizeof(jmy_prefetch_t));
+    jmy_batch_t **ring = calloc(depth, sizeof(jmy_batch_t *));
+    if (p == NULL || ring == NULL) {
+        free(p);
+        free(ring);
+        JANET_OUT_OF_MEMORY;
+    }
+    p->conn = ctx->conn;
+    p->r = rows->r;
+    p->num_fields = rows->num_fields;
+    p->batch_rows = batch_rows;
+    p->depth = depth;
+    p->ring = ring;
+    p->refs = 2;
+    p->rows = rows;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    pthread_cond_init(&p->space, NULL);
+    if (pthread_create(&p->thread, NULL, prefetch_worker, p)) {
+        p->refs = 1;
+        prefetch_release(p);
+        janet_panic("could not start prefetch thread");
+    }
+    p->running = true;
+    rows->prefetch = p;
+    ctx->prefetch = p;
+
+    return argv[0];
+}
+
+static Janet rows_next_batch(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    bool wait = argc < 2 || janet_truthy(argv[1]);
+    if (rows->r == NULL) {
+        janet_panic("mysql/rows is disconnected");
+    }
+    jmy_prefetch_t *p = rows->prefetch;
+    if (p == NULL) {
+        janet_panic("mysql/rows are not prefetched");
+    }
+
+    jmy_batch_t *b = NULL;
+    pthread_mutex_lock(&p->lock);
+    if (!wait && p->count == 0 && !p->done) {
+        pthread_mutex_unlock(&p->lock);
+        return janet_wrap_false();
+    }
+    while (p->count == 0 && !p->done) {
+        pthread_cond_wait(&p->ready, &p->lock);
+    }
+    if (p->count > 0) {
+        b = p->ring[p->head];
+        p->head = (p->head + 1) % p->depth;
+        p->count--;
+        pthread_cond_signal(&p->space);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (b == NULL) {
+        rows_prefetch_done(rows);
+        if (p->error_code) {
+            janet_panicv(make_error("mysql_fetch_row", p->error_code, p->sqlstate, p->message));
+        }
+        return janet_wrap_nil();
+    }
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    char **row = janet_smalloc(sizeof(char *) * num_fields);
+    unsigned long *lengths = janet_smalloc(sizeof(unsigned long) * num_fields);
+    JanetArray *a = janet_array(b->rows);
+    for (int i = 0; i < b->rows; i++) {
+        for (int j = 0; j < num_fields; j++) {
+            int cell = i * num_fields + j;
+            bool null = b->lengths[cell] == PREFETCH_NULL;
+            row[j] = null ? NULL : b->data + b->offsets[cell];
+            lengths[j] = null ? 0 : b->lengths[cell];
+        }
+        janet_array_push(a, text_row_table(row, lengths, num_fields, fields, rows->decoders));
+    }
+    janet_sfree(lengths);
+    janet_sfree(row);
+    batch_free(b);
+
+    return janet_wrap_array(a);
+}
+
+static Janet rows_free(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    if (rows->r == NULL) {
+        return janet_wrap_nil();
+    }
+    if (rows->prefetch != NULL) {
+        rows_prefetch_done(rows);
+        prefetch_release(rows->prefetch);
+        rows->prefetch = NULL;
+    }
+    mysql_free_result(rows->r);
+    rows->r = NULL;
+
+    /* Statement results live in the statement until they are freed or it
+     * is executed again. */
+    if (rows->statement != NULL && rows_statement_current(rows)) {
+        mysql_stmt_free_result(rows->statement);
+    }
+    return janet_wrap_nil();
+}
+
+static JanetMethod rows_methods[] = {
+    {"close", rows_free}, /* So rows can be used with 'with' */
+    {NULL, NULL}
+};
+
+static int rows_get(void *p, Janet key, Janet *out) {
+    jmy_rows_t *rows = (jmy_rows_t *)p;
+    if (janet_checktype(key, JANET_KEYWORD)) {
+        return janet_getmethod(janet_unwrap_keyword(key), rows_methods, out);
+    }
+    if (!janet_checkint64(key)) {
+        return 0;
+    }
+    int64_t i = rows_index(rows, key);
+    jmy_row_t *row = (jmy_row_t *)janet_abstract(&row_type, sizeof(jmy_row_t));
+    row->rows = rows;
+    row->snapshot = NULL;
+    row->index = i;
+    *out = janet_wrap_abstract(row);
+    return 1;
+}
+
+static Janet rows_call(void *p, int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_rows_t *rows = (jmy_rows_t *)p;
+    int64_t i = rows_index(rows, argv[0]);
+    return rows_decode_at(rows, i, -1);
+}
+
+static Janet rows_next(void *p, Janet key) {
+    jmy_rows_t *rows = (jmy_rows_t *)p;
+    bool live = rows->r != NULL && (rows->statement == NULL || rows_statement_current(rows));
+    int64_t n = live ? rows_count(rows) : 0;
+    int64_t i = janet_checktype(key, JANET_NIL) ? 0 : (int64_t)janet_unwrap_number(key) + 1;
+    return i < n ? janet_wrap_number((double)i) : janet_wrap_nil();
+}
+
+static size_t rows_length(void *p, size_t size) {
+    (void)size;
+    jmy_rows_t *rows = (jmy_rows_t *)p;
+    __ensure_rows_ok(rows);
+    int64_t n = rows_count(rows);
+    if (n < 0) {
+        janet_panic("mysql/rows are not buffered");
+    }
+    return (size_t)n;
+}
+
+static Janet rows_unpack(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_checkabstract(argv[0], &snapshot_type);
+    if (snap != NULL) {
+        __ensure_snapshot_ok(snap);
+        JanetArray *a = janet_array((int32_t)snap->num_rows);
+        for (int64_t i = 0; i < snap->num_rows; i++) {
+            janet_array_push(a, snapshot_row_table(snap, i));
+        }
+        return janet_wrap_array(a);
+    }
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    __ensure_rows_ok(rows);
+
+    if (rows->statement == NULL) {
+        return rows_text_unpack(rows);
+    } else {
+        return rows_binary_unpack(rows);
+    }
+}
+
+/* The table at slot i of a, cleared unless it holds exactly the result's
+ * columns, or a new table placed there. */
+static JanetTable *reuse_row_table(JanetArray *a, int32_t i, int num_fields) {
+    if (i < a->count && janet_checktype(a->data[i], JANET_TABLE)) {
+        return janet_unwrap_table(a->data[i]);
+    }
+    JanetTable *t = janet_table(num_fields);
+    if (i < a->count) {
+        a->data[i] = janet_wrap_table(t);
+    } else {
+        janet_array_push(a, janet_wrap_table(t));
+    }
+    return t;
+}
+
+/* Remove the keys of a reused table that aren't columns of the result just
+ * filled in, of which present had values. Matching keys are kept, so
+ * their slots are reused row after row. */
+static void drop_stale_keys(JanetTable *t, int present, int num_fields, MYSQL_FIELD *fields) {
+    if (t->count == present) {
+        return;
+    }
+    for (int32_t k = 0; k < t->capacity; k++) {
+        Janet key = t->data[k].key;
+        if (janet_checktype(key, JANET_NIL)) {
+            continue;
+        }
+        bool current = false;
+        if (janet_checktype(key, JANET_KEYWORD)) {
+            const uint8_t *name = janet_unwrap_keyword(key);
+            for (int j = 0; j < num_fields && !current; j++) {
+                current = !janet_cstrcmp(name, fields[j].name);
+            }
+        }
+        if (!current) {
+            janet_table_remove(t, key);
+        }
+    }
+}
+
+static Janet rows_unpack_into(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    JanetArray *a = janet_getarray(argv, 1);
+    __ensure_rows_ok(rows);
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    int32_t i = 0;
+
+    if (rows->statement == NULL) {
+        if (rows->buffered) {
+            mysql_data_seek(rows->r, 0);
+        }
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(rows->r)) != NULL) {
+            unsigned long *lengths = mysql_fetch_lengths(rows->r);
+            JanetTable *t = reuse_row_table(a, i++, num_fields);
+            drop_stale_keys(t, text_row_fill(t, row, lengths, num_fields, fields, rows->decoders), num_fields, fields);
+        }
+    } else {
+        jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+        if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+            stmt_panic(rows->statement, "mysql_stmt_bind_result");
+        }
+        if (rows->buffered) {
+            mysql_stmt_data_seek(rows->statement, 0);
+        }
+        while (stmt_fetch_row(rows->statement, &binds)) {
+            JanetTable *t = reuse_row_table(a, i++, num_fields);
+            drop_stale_keys(t, binary_row_fill(t, &binds, num_fields, fields, rows->decoders), num_fields, fields);
+        }
+        query_bind_free(binds);
+    }
+
+    janet_array_setcount(a, i);
+    return janet_wrap_array(a);
+}
+
+/* Below this many rows per thread, starting threads costs more than it saves. */
+#define DECODE_ROWS_PER_THREAD 8192
+
+/* A range of stored text rows whose number and time columns are parsed
+ * into plain C arrays. Workers touch no Janet state. */
+typedef struct {
+    MYSQL_ROW *rows;
+    MYSQL_FIELD *fields;
+    int num_fields;
+    int64_t begin;
+    int64_t end;
+    double **numbers;
+    MYSQL_TIME **times;
+} jmy_decode_job_t;
+
+static void *decode_columns_worker(void *p) {
+    jmy_decode_job_t *job = (jmy_decode_job_t *)p;
+    for (int64_t i = job->begin; i < job->end; i++) {
+        MYSQL_ROW row = job->rows[i];
+        for (int j = 0; j < job->num_fields; j++) {
+            if (row[j] == NULL) {
+                continue;
+            }
+            if (job->numbers[j] != NULL) {
+                job->numbers[j][i] = text_number(row[j], &job->fields[j]);
+            } else if (job->times[j] != NULL) {
+                text_time(row[j], strlen(row[j]), &job->fields[j], &job->times[j][i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void decode_columns_parallel(jmy_decode_job_t *all, int64_t n, int threads) {
+    if (threads > n / DECODE_ROWS_PER_THREAD) {
+        threads = (int)(n / DECODE_ROWS_PER_THREAD);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    jmy_decode_job_t *jobs = janet_smalloc(sizeof(jmy_decode_job_t) * threads);
+    pthread_t *tids = janet_smalloc(sizeof(pthread_t) * threads);
+    bool *started = janet_smalloc(sizeof(bool) * threads);
+    int64_t per = n / threads;
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = *all;
+        jobs[t].begin = t * per;
+        jobs[t].end = (t == threads - 1) ? n : (t + 1) * per;
+        /* The last range runs here, as does any a thread couldn't take. */
+        started[t] = t < threads - 1 && pthread_create(&tids[t], NULL, decode_columns_worker, &jobs[t]) == 0;
+    }
+    for (int t = 0; t < threads; t++) {
+        if (!started[t]) {
+            decode_columns_worker(&jobs[t]);
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+    janet_sfree(started);
+    janet_sfree(tids);
+    janet_sfree(jobs);
+}
+
+static void rows_text_columns(jmy_rows_t *rows, JanetArray **cols, int threads) {
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    int64_t n = (int64_t)mysql_num_rows(rows->r);
+    if (n == 0) {
+        return;
+    }
+
+    /* Stored rows stay put, but the lengths array is reused by every fetch. */
+    MYSQL_ROW *ptrs = janet_smalloc(sizeof(MYSQL_ROW) * n);
+    unsigned long *lengths = janet_smalloc(sizeof(unsigned long) * n * num_fields);
+    mysql_data_seek(rows->r, 0);
+    for (int64_t i = 0; i < n; i++) {
+        ptrs[i] = mysql_fetch_row(rows->r);
+        memcpy(&lengths[i * num_fields], mysql_fetch_lengths(rows->r), sizeof(unsigned long) * num_fields);
+    }
+
+    jmy_decode_job_t job;
+    job.rows = ptrs;
+    job.fields = fields;
+    job.num_fields = num_fields;
+    job.numbers = janet_smalloc(sizeof(double *) * num_fields);
+    job.times = janet_smalloc(sizeof(MYSQL_TIME *) * num_fields);
+    for (int j = 0; j < num_fields; j++) {
+        /* Only the default representations are parsed ahead. */
+        job.numbers[j] = rows->decoders[j].text == text_default_number ? janet_smalloc(sizeof(double) * n) : NULL;
+        job.times[j] = rows->decoders[j].text == text_default_time ? janet_smalloc(sizeof(MYSQL_TIME) * n) : NULL;
+    }
+    decode_columns_parallel(&job, n, threads);
+
+    /* Boxing allocates, so it stays on the Janet thread. */
+    for (int j = 0; j < num_fields; j++) {
+        JanetArray *a = cols[j];
+        janet_array_ensure(a, (int32_t)n, 1);
+        for (int64_t i = 0; i < n; i++) {
+            char *v = ptrs[i][j];
+            Janet jv;
+            if (v == NULL) {
+                jv = janet_wrap_nil();
+            } else if (job.numbers[j] != NULL) {
+                jv = wrap_text_number(job.numbers[j][i], &fields[j]);
+            } else if (job.times[j] != NULL) {
+                jv = text_time_struct(&job.times[j][i], &fields[j]);
+            } else {
+                jv = decode_text_with(&rows->decoders[j], v, lengths[i * num_fields + j], &fields[j]);
+            }
+            a->data[i] = jv;
+        }
+        a->count = (int32_t)n;
+        if (job.numbers[j] != NULL) {
+            janet_sfree(job.numbers[j]);
+        }
+        if (job.times[j] != NULL) {
+            janet_sfree(job.times[j]);
+        }
+    }
+
+    janet_sfree(job.times);
+    janet_sfree(job.numbers);
+    janet_sfree(lengths);
+    janet_sfree(ptrs);
+}
+
+/* Decode every value of rows into the arrays in cols, one per column. */
+static void rows_fill_columns(jmy_rows_t *rows, JanetArray **cols, int threads) {
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    if (rows->statement == NULL && rows->buffered) {
+        rows_text_columns(rows, cols, threads);
+    } else if (rows->statement == NULL) {
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(rows->r)) != NULL) {
+            unsigned long *lengths = mysql_fetch_lengths(rows->r);
+            for (int j = 0; j < num_fields; j++) {
+                janet_array_push(cols[j], decode_text_with(&rows->decoders[j], row[j], lengths[j], &fields[j]));
+            }
+        }
+    } else {
+        /* Binary rows arrive already parsed, leaving nothing to spread out. */
+        jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+        if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+            stmt_panic(rows->statement, "mysql_stmt_bind_result");
+        }
+        if (rows->buffered) {
+            mysql_stmt_data_seek(rows->statement, 0);
+        }
+        while (stmt_fetch_row(rows->statement, &binds)) {
+            for (int j = 0; j < num_fields; j++) {
+                janet_array_push(cols[j], decode_binary_with(&rows->decoders[j], &binds.binds[j], &fields[j]));
+            }
+        }
+        query_bind_free(binds);
+    }
+}
+
+static Janet rows_unpack_columns(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_checkabstract(argv[0], &snapshot_type);
+    if (snap != NULL) {
+        __ensure_snapshot_ok(snap);
+        JanetTable *t = janet_table(snap->num_fields);
+        for (int j = 0; j < snap->num_fields; j++) {
+            janet_table_put(t, safe_ckeywordv(snapshot_name(snap, j)), snapshot_column(snap, j));
+        }
+        return janet_wrap_table(t);
+    }
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    int threads = janet_optinteger(argv, argc, 1, 1);
+    __ensure_rows_ok(rows);
+    if (threads < 1) {
+        janet_panicf("expected a positive thread count, got %d", threads);
+    }
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    JanetArray **cols = janet_smalloc(sizeof(JanetArray *) * num_fields);
+    JanetTable *t = janet_table(num_fields);
+    for (int j = 0; j < num_fields; j++) {
+        cols[j] = janet_array(0);
+        janet_table_put(t, safe_ckeywordv(fields[j].name), janet_wrap_array(cols[j]));
+    }
+    rows_fill_columns(rows, cols, threads);
+
+    janet_sfree(cols);
+    return janet_wrap_table(t);
+}
+
+/* Watching a query re-runs it and hashes each row's raw bytes, so only the
+ * rows that changed since the previous run are decoded. */
+
+typedef struct {
+    uint64_t key_hash;
+    uint64_t row_hash;
+    /* Offset of the key columns' bytes in the table's arena. */
+    size_t key;
+    uint32_t key_len;
+    bool used;
+    bool seen;
+} jmy_watch_entry_t;
+
+/* Open addressing from key hash to row hash, with the key bytes kept so
+ * colliding keys are told apart and a deleted row's key can be decoded. */
+typedef struct {
+    jmy_watch_entry_t *entries;
+    size_t capacity;
+    uint8_t *keys;
+    size_t keys_len;
+    size_t keys_cap;
+} jmy_watch_table_t;
+
+typedef struct {
+    jmy_watch_table_t current;
+    /* The next run's table while its changes are decoded, owned here so a
+     * failing decoder doesn't leak it. */
+    jmy_watch_table_t pending;
+} jmy_watch_t;
+
+static void watch_table_free(jmy_watch_table_t *t) {
+    janet_free(t->entries);
+    janet_free(t->keys);
+    memset(t, 0, sizeof(jmy_watch_table_t));
+}
+
+static int watch_gc(void *p, size_t s) {
+    (void)s;
+    jmy_watch_t *w = (jmy_watch_t *)p;
+    watch_table_free(&w->current);
+    watch_table_free(&w->pending);
+    return 0;
+}
+
+static const JanetAbstractType watch_type = {
+    "mysql/watch",
+    watch_gc,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+/* Not cryptographic, a changed row going unnoticed needs a 64 bit collision. */
+static uint64_t watch_hash(uint64_t h, const void *data, size_t n) {
+    const uint8_t *b = (const uint8_t *)data;
+    for (; n >= 8; b += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, b, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    uint64_t w = 0;
+    memcpy(&w, b, n);
+    h = (h ^ w ^ ((uint64_t)n << 56)) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
+
+static void watch_append(jmy_watch_table_t *t, const void *data, size_t n) {
+    if (t->keys_len + n > t->keys_cap) {
+        size_t cap = t->keys_cap ? t->keys_cap * 2 : 4096;
+        while (cap < t->keys_len + n) {
+            cap *= 2;
+        }
+        uint8_t *keys = janet_realloc(t->keys, cap);
+        if (keys == NULL) {
+            JANET_OUT_OF_MEMORY;
+        }
+        t->keys = keys;
+        t->keys_cap = cap;
+    }
+    memcpy(t->keys + t->keys_len, data, n);
+    t->keys_len += n;
+}
+
+/* The entry for key, or the empty slot it would go in. */
+static jmy_watch_entry_t *watch_find(jmy_watch_table_t *t, uint64_t hash, const uint8_t *key, uint32_t len) {
+    size_t mask = t->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        jmy_watch_entry_t *e = &t->entries[i];
+        if (!e->used || (e->key_hash == hash && e->key_len == len && !memcmp(t->keys + e->key, key, len))) {
+            return e;
+        }
+    }
+}
+
+/* Decode a key stored by watch_diff, each column as a 4 byte length, or
+ * UINT32_MAX for NULL, then the bytes and a NUL for the text decoders. */
+static Janet watch_key_table(jmy_watch_table_t *t, jmy_watch_entry_t *e, int *key_index, int32_t key_count,
+                             MYSQL_FIELD *fields, const jmy_decoder_t *decoders) {
+    JanetTable *out = janet_table(key_count);
+    const uint8_t *p = t->keys + e->key;
+    for (int32_t k = 0; k < key_count; k++) {
+        int j = key_index[k];
+        uint32_t len;
+        memcpy(&len, p, 4);
+        p += 4;
+        Janet v = janet_wrap_nil();
+        if (len != UINT32_MAX) {
+            v = decode_text_with(&decoders[j], (char *)p, len, &fields[j]);
+            p += len;
+        }
+        p++;
+        janet_table_put(out, safe_ckeywordv(fields[j].name), v);
+    }
+    return janet_wrap_table(out);
+}
+
+typedef struct {
+    MYSQL_ROW row;
+    /* Offset of the row's lengths in the lengths array. */
+    size_t lengths;
+    bool inserted;
+} jmy_watch_change_t;
+
+static Janet watch_new(int32_t argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    jmy_watch_t *w = (jmy_watch_t *)janet_abstract(&watch_type, sizeof(jmy_watch_t));
+    memset(w, 0, sizeof(jmy_watch_t));
+    return janet_wrap_abstract(w);
+}
+
+static Janet watch_diff(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    jmy_watch_t *w = (jmy_watch_t *)janet_getabstract(argv, 0, &watch_type);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 1, &rows_type);
+    __ensure_rows_ok(rows);
+    if (rows->statement != NULL || !rows->buffered) {
+        janet_panic("mysql/watch needs buffered rows from a text query");
+    }
+    JanetView key_cols = janet_getindexed(argv, 2);
+    if (key_cols.len == 0) {
+        janet_panic("mysql/watch needs at least one key column");
+    }
+    int *key_index = janet_smalloc(sizeof(int) * key_cols.len);
+    for (int32_t k = 0; k < key_cols.len; k++) {
+        key_index[k] = rows_field_index(rows, key_cols.items[k]);
+        if (key_index[k] < 0) {
+            janet_panicf("key column %v is not in the watched query", key_cols.items[k]);
+        }
+    }
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    int64_t n = rows_count(rows);
+
+    /* A failed earlier diff may have left its table behind. */
+    watch_table_free(&w->pending);
+    jmy_watch_table_t *next = &w->pending;
+    next->capacity = 16;
+    while (next->capacity < 2 * (size_t)n + 2) {
+        next->capacity <<= 1;
+    }
+    next->entries = janet_calloc(next->capacity, sizeof(jmy_watch_entry_t));
+    if (next->entries == NULL) {
+        JANET_OUT_OF_MEMORY;
+    }
+    jmy_watch_table_t *prev = &w->current;
+    for (size_t i = 0; i < prev->capacity; i++) {
+        prev->entries[i].seen = false;
+    }
+
+    /* Nothing is decoded until every row has been compared. */
+    int32_t changes_cap = 16, changes_count = 0;
+    jmy_watch_change_t *changes = janet_smalloc(sizeof(jmy_watch_change_t) * changes_cap);
+    unsigned long *lengths_copy = janet_smalloc(sizeof(unsigned long) * changes_cap * num_fields);
+
+    mysql_data_seek(rows->r, 0);
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(rows->r)) != NULL) {
+        unsigned long *lengths = mysql_fetch_lengths(rows->r);
+
+        size_t start = next->keys_len;
+        for (int32_t k = 0; k < key_cols.len; k++) {
+            int j = key_index[k];
+            uint32_t len = row[j] == NULL ? UINT32_MAX : (uint32_t)lengths[j];
+            watch_append(next, &len, 4);
+            if (row[j] != NULL) {
+                watch_append(next, row[j], lengths[j]);
+            }
+            watch_append(next, "", 1);
+        }
+        uint32_t key_len = (uint32_t)(next->keys_len - start);
+        const uint8_t *key = next->keys + start;
+        uint64_t key_hash = watch_hash(0, key, key_len);
+        jmy_watch_entry_t *e = watch_find(next, key_hash, key, key_len);
+        if (e->used) {
+            /* A repeated key keeps its first row. */
+            next->keys_len = start;
+            continue;
+        }
+
+        uint64_t row_hash = 0;
+        for (int j = 0; j < num_fields; j++) {
+            uint64_t len = row[j] == NULL ? UINT64_MAX : lengths[j];
+            row_hash = watch_hash(row_hash, &len, 8);
+            if (row[j] != NULL) {
+                row_hash = watch_hash(row_hash, row[j], lengths[j]);
+            }
+        }
+        e->used = true;
+        e->seen = false;
+        e->key_hash = key_hash;
+        e->row_hash = row_hash;
+        e->key = start;
+        e->key_len = key_len;
+
+        jmy_watch_entry_t *old = prev->capacity ? watch_find(prev, key_hash, key, key_len) : NULL;
+        bool inserted = old == NULL || !old->used;
+        if (!inserted) {
+            old->seen = true;
+            if (old->row_hash == row_hash) {
+                continue;
+            }
+        }
+        if (changes_count == changes_cap) {
+            changes_cap *= 2;
+            changes = janet_srealloc(changes, sizeof(jmy_watch_change_t) * changes_cap);
+            lengths_copy = janet_srealloc(lengths_copy, sizeof(unsigned long) * changes_cap * num_fields);
+        }
+        changes[changes_count].row = row;
+        changes[changes_count].lengths = (size_t)changes_count * num_fields;
+        changes[changes_count].inserted = inserted;
+        memcpy(lengths_copy + changes[changes_count].lengths, lengths, sizeof(unsigned long) * num_fields);
+        changes_count++;
+    }
+
+    JanetArray *inserted = janet_array(0);
+    JanetArray *updated = janet_array(0);
+    JanetArray *deleted = janet_array(0);
+    for (int32_t i = 0; i < changes_count; i++) {
+        Janet t = text_row_table(changes[i].row, lengths_copy + changes[i].lengths, num_fields, fields, rows->decoders);
+        janet_array_push(changes[i].inserted ? inserted : updated, t);
+    }
+    /* Rows of the previous run that this one didn't have were deleted. */
+    for (size_t i = 0; i < prev->capacity; i++) {
+        jmy_watch_entry_t *e = &prev->entries[i];
+        if (e->used && !e->seen) {
+            janet_array_push(deleted, watch_key_table(prev, e, key_index, key_cols.len, fields, rows->decoders));
+        }
+    }
+    janet_sfree(lengths_copy);
+    janet_sfree(changes);
+    janet_sfree(key_index);
+
+    watch_table_free(&w->current);
+    w->current = w->pending;
+    memset(&w->pending, 0, sizeof(jmy_watch_table_t));
+
+    JanetKV *st = janet_struct_begin(3);
+    janet_struct_put(st, janet_ckeywordv("inserted"), janet_wrap_array(inserted));
+    janet_struct_put(st, janet_ckeywordv("updated"), janet_wrap_array(updated));
+    janet_struct_put(st, janet_ckeywordv("deleted"), janet_wrap_array(deleted));
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+/* True if any of the 8 bytes in w is a control character, '"' or '\\',
+ * so plain runs of a string are scanned a word at a time. */
+static inline int json_word_special(uint64_t w) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t quote = w ^ (ones * '"');
+    uint64_t slash = w ^ (ones * '\\');
+    uint64_t ctrl = (w - ones * 0x20) & ~w;
+    quote = (quote - ones) & ~quote;
+    slash = (slash - ones) & ~slash;
+    return ((ctrl | quote | slash) & highs) != 0;
+}
+
+static void json_write_string(JanetBuffer *buffer, const uint8_t *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    janet_buffer_push_u8(buffer, '"');
+    size_t start = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (i + 8 <= len) {
+            uint64_t w;
+            memcpy(&w, s + i, 8);
+            if (!json_word_special(w)) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = s[i];
+        if (c < 0x20 || c == '"' || c == '\\') {
+            janet_buffer_push_bytes(buffer, s + start, i - start);
+            janet_buffer_push_u8(buffer, '\\');
+            switch (c) {
+                case '"':
+                case '\\':
+                    janet_buffer_push_u8(buffer, c);
+                    break;
+                case '\n':
+                    janet_buffer_push_u8(buffer, 'n');
+                    break;
+                case '\r':
+                    janet_buffer_push_u8(buffer, 'r');
+                    break;
+                case '\t':
+                    janet_buffer_push_u8(buffer, 't');
+                    break;
+                case '\b':
+                    janet_buffer_push_u8(buffer, 'b');
+                    break;
+                case '\f':
+                    janet_buffer_push_u8(buffer, 'f');
+                    break;
+                default: {
+                    uint8_t u[5] = {'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                    janet_buffer_push_bytes(buffer, u, 5);
+                    break;
+                }
+            }
+            start = i + 1;
+        }
+        i++;
+    }
+    janet_buffer_push_bytes(buffer, s + start, len - start);
+    janet_buffer_push_u8(buffer, '"');
+}
+
+/* Numeric text from ZEROFILL columns, and YEAR 0000, is padded with
+ * leading zeros, which a JSON number can't have. */
+static void json_write_number(JanetBuffer *buffer, const char *v, unsigned long l) {
+    unsigned long i = 0;
+    if (l > 0 && v[0] == '-') {
+        janet_buffer_push_u8(buffer, '-');
+        i++;
+    }
+    while (i + 1 < l && v[i] == '0' && isdigit((unsigned char)v[i + 1])) {
+        i++;
+    }
+    janet_buffer_push_bytes(buffer, (const uint8_t *)v + i, l - i);
+}
+
+static void json_write_text(JanetBuffer *buffer, char *v, unsigned long l, MYSQL_FIELD *field) {
+    if (v == NULL) {
+        janet_buffer_push_cstring(buffer, "null");
+        return;
+    }
+
+    switch (field->type) {
+        case MYSQL_TYPE_NULL:
+            janet_buffer_push_cstring(buffer, "null");
+            break;
+
+        case MYSQL_TYPE_TINY:
+            if (field->length == 1) {
+                janet_buffer_push_cstring(buffer, atoi(v) != 0 ? "true" : "false");
+                break;
+            }
+        /* fall-thru */
+
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_YEAR:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_DECIMAL:
+        case MYSQL_TYPE_NEWDECIMAL:
+            json_write_number(buffer, v, l);
+            break;
+
+        case MYSQL_TYPE_JSON:
+            /* Already valid JSON text. */
+            janet_buffer_push_bytes(buffer, (uint8_t *)v, l);
+            break;
+
+        default:
+            json_write_string(buffer, (uint8_t *)v, l);
+            break;
+    }
+}
+
+static bool is_temporal(int type) {
+    switch (type) {
+        case MYSQL_TYPE_TIMESTAMP:
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP2:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Format a non-null numeric or temporal binary value as text into buf,
+ * returning its length, or -1 if the value is already a byte string. */
+static int binary_text(MYSQL_BIND *bind, MYSQL_FIELD *field, char *buf, size_t size) {
+    char *v = bind->buffer;
+    bool is_unsigned = (field->flags & UNSIGNED_FLAG) != 0;
+
+    switch (bind->buffer_type) {
+        case MYSQL_TYPE_TINY:
+            return snprintf(buf, size, "%d", is_unsigned ? *(unsigned char *)v : *(signed char *)v);
+
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_YEAR:
+            return snprintf(buf, size, "%d", is_unsigned ? *(unsigned short *)v : *(short *)v);
+
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+            if (is_unsigned) {
+                return snprintf(buf, size, "%u", *(unsigned int *)v);
+            }
+            return snprintf(buf, size, "%d", *(int *)v);
+
+        case MYSQL_TYPE_LONGLONG:
+            if (is_unsigned) {
+                return snprintf(buf, size, "%llu", *(unsigned long long *)v);
+            }
+            return snprintf(buf, size, "%lld", *(long long *)v);
+
+        case MYSQL_TYPE_FLOAT:
+            return snprintf(buf, size, "%.9g", *(float *)v);
+
+        case MYSQL_TYPE_DOUBLE:
+            return snprintf(buf, size, "%.17g", *(double *)v);
+
+        case MYSQL_TYPE_TIMESTAMP:
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_TIME:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_TIMESTAMP2: {
+            MYSQL_TIME *t = (MYSQL_TIME *)v;
+            if (t->time_type == MYSQL_TIMESTAMP_DATE) {
+                return snprintf(buf, size, "%04u-%02u-%02u", t->year, t->month, t->day);
+            }
+            if (t->time_type == MYSQL_TIMESTAMP_TIME) {
+                return snprintf(buf, size, "%s%02u:%02u:%02u", t->neg ? "-" : "", t->hour, t->minute, t->second);
+            }
+            if (t->second_part) {
+                return snprintf(buf, size, "%04u-%02u-%02u %02u:%02u:%02u.%06lu",
+                                t->year, t->month, t->day, t->hour, t->minute, t->second, t->second_part);
+            }
+            return snprintf(buf, size, "%04u-%02u-%02u %02u:%02u:%02u",
+                            t->year, t->month, t->day, t->hour, t->minute, t->second);
+        }
+
+        default:
+            return -1;
+    }
+}
+
+static void json_write_binary(JanetBuffer *buffer, MYSQL_BIND *bind, MYSQL_FIELD *field) {
+    if (*bind->is_null || bind->buffer_type == MYSQL_TYPE_NULL) {
+        janet_buffer_push_cstring(buffer, "null");
+        return;
+    }
+
+    switch (bind->buffer_type) {
+        case MYSQL_TYPE_TINY:
+            if (field->length == 1) {
+                janet_buffer_push_cstring(buffer, *(char *)bind->buffer ? "true" : "false");
+                return;
+            }
+            break;
+
+        case MYSQL_TYPE_NEWDECIMAL:
+            json_write_number(buffer, bind->buffer, *bind->length);
+            return;
+
+        case MYSQL_TYPE_JSON:
+            /* Already valid JSON text. */
+            janet_buffer_push_bytes(buffer, bind->buffer, *bind->length);
+            return;
+
+        default:
+            break;
+    }
+
+    char buf[64];
+    int n = binary_text(bind, field, buf, sizeof(buf));
+    if (n < 0) {
+        json_write_string(buffer, bind->buffer, *bind->length);
+    } else if (is_temporal(bind->buffer_type)) {
+        json_write_string(buffer, (uint8_t *)buf, n);
+    } else {
+        janet_buffer_push_bytes(buffer, (uint8_t *)buf, n);
+    }
+}
+
+/* The quoted and escaped "name": prefix of every column, built once per result. */
+static int32_t *json_keys(JanetBuffer *keys, int num_fields, MYSQL_FIELD *fields) {
+    int32_t *offsets = janet_smalloc(sizeof(int32_t) * (num_fields + 1));
+    for (int j = 0; j < num_fields; j++) {
+        offsets[j] = keys->count;
+        janet_buffer_push_u8(keys, j == 0 ? '{' : ',');
+        json_write_string(keys, (uint8_t *)fields[j].name, strlen(fields[j].name));
+        janet_buffer_push_u8(keys, ':');
+    }
+    offsets[num_fields] = keys->count;
+    return offsets;
+}
+
+static Janet rows_write_json(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    __ensure_rows_ok(rows);
+    JanetBuffer *buffer = janet_getbuffer(argv, 1);
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    JanetBuffer *keys = janet_buffer(num_fields * 16);
+    int32_t *offsets = json_keys(keys, num_fields, fields);
+
+    /* Buffered rows are written from the start each time, like rows-unpack. */
+    janet_buffer_push_u8(buffer, '[');
+    bool first = true;
+    if (rows->statement == NULL) {
+        if (rows->buffered) {
+            mysql_data_seek(rows->r, 0);
+        }
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(rows->r)) != NULL) {
+            unsigned long *lengths = mysql_fetch_lengths(rows->r);
+            if (!first) {
+                janet_buffer_push_u8(buffer, ',');
+            }
+            first = false;
+            for (int j = 0; j < num_fields; j++) {
+                janet_buffer_push_bytes(buffer, keys->data + offsets[j], offsets[j + 1] - offsets[j]);
+                json_write_text(buffer, row[j], lengths[j], &fields[j]);
+            }
+            janet_buffer_push_cstring(buffer, num_fields ? "}" : "{}");
+        }
+    } else {
+        jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+        if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+            stmt_panic(rows->statement, "mysql_stmt_bind_result");
+        }
+        if (rows->buffered) {
+            mysql_stmt_data_seek(rows->statement, 0);
+        }
+        while (stmt_fetch_row(rows->statement, &binds)) {
+            if (!first) {
+                janet_buffer_push_u8(buffer, ',');
+            }
+            first = false;
+            for (int j = 0; j < num_fields; j++) {
+                janet_buffer_push_bytes(buffer, keys->data + offsets[j], offsets[j + 1] - offsets[j]);
+                json_write_binary(buffer, &binds.binds[j], &fields[j]);
+            }
+            janet_buffer_push_cstring(buffer, num_fields ? "}" : "{}");
+        }
+        query_bind_free(binds);
+    }
+    janet_buffer_push_u8(buffer, ']');
+
+    janet_sfree(offsets);
+    return janet_wrap_buffer(buffer);
+}
+
+typedef enum {
+    EXPORT_QUOTE_MINIMAL,
+    EXPORT_QUOTE_ALL,
+    EXPORT_QUOTE_NONE
+} jmy_export_quote_t;
+
+typedef struct {
+    bool tsv;
+    uint8_t delimiter;
+    jmy_export_quote_t quote;
+    JanetByteView null;
+    int32_t chunk_size;
+} jmy_export_opts_t;
+
+static jmy_export_opts_t export_opts(Janet options) {
+    jmy_export_opts_t o;
+    Janet format = janet_get(options, janet_ckeywordv("format"));
+    o.tsv = janet_checktype(format, JANET_KEYWORD) && !janet_cstrcmp(janet_unwrap_keyword(format), "tsv");
+    if (!o.tsv && !janet_checktype(format, JANET_NIL) &&
+            !(janet_checktype(format, JANET_KEYWORD) && !janet_cstrcmp(janet_unwrap_keyword(format), "csv"))) {
+        janet_panicf("expected :csv or :tsv format, got %v", format);
+    }
+
+    o.delimiter = o.tsv ? '\t' : ',';
+    Janet delimiter = janet_get(options, janet_ckeywordv("delimiter"));
+    if (!janet_checktype(delimiter, JANET_NIL)) {
+        JanetByteView d = janet_getbytes(&delimiter, 0);
+        if (d.len != 1) {
+            janet_panic("delimiter must be a single byte");
+        }
+        o.delimiter = d.bytes[0];
+    }
+
+    o.quote = EXPORT_QUOTE_MINIMAL;
+    Janet quote = janet_get(options, janet_ckeywordv("quote"));
+    if (janet_checktype(quote, JANET_KEYWORD)) {
+        const uint8_t *q = janet_unwrap_keyword(quote);
+        if (!janet_cstrcmp(q, "all")) {
+            o.quote = EXPORT_QUOTE_ALL;
+        } else if (!janet_cstrcmp(q, "none")) {
+            o.quote = EXPORT_QUOTE_NONE;
+        } else if (janet_cstrcmp(q, "minimal")) {
+            janet_panicf("expected :minimal, :all or :none quoting, got %v", quote);
+        }
+    }
+
+    Janet null = janet_get(options, janet_ckeywordv("null"));
+    if (janet_checktype(null, JANET_NIL)) {
+        null = janet_cstringv(o.tsv ? "\\N" : "");
+    }
+    o.null = janet_getbytes(&null, 0);
+
+    Janet chunk_size = janet_get(options, janet_ckeywordv("chunk-size"));
+    o.chunk_size = janet_checktype(chunk_size, JANET_NIL) ? 1024 * 1024 : janet_getnat(&chunk_size, 0);
+    return o;
+}
+
+static void export_write_field(JanetBuffer *buffer, const uint8_t *v, size_t len, jmy_export_opts_t *o) {
+    if (o->tsv) {
+        /* Backslash escapes, as LOAD DATA INFILE expects. */
+        size_t start = 0;
+        for (size_t i = 0; i < len; i++) {
+            uint8_t c = v[i];
+            uint8_t e;
+            if (c == '\t' || c == o->delimiter) {
+                e = c == '\t' ? 't' : c;
+            } else if (c == '\n') {
+                e = 'n';
+            } else if (c == '\r') {
+                e = 'r';
+            } else if (c == '\\') {
+                e = '\\';
+            } else {
+                continue;
+            }
+            janet_buffer_push_bytes(buffer, v + start, i - start);
+            janet_buffer_push_u8(buffer, '\\');
+            janet_buffer_push_u8(buffer, e);
+            start = i + 1;
+        }
+        janet_buffer_push_bytes(buffer, v + start, len - start);
+        return;
+    }
+
+    bool quote = o->quote == EXPORT_QUOTE_ALL;
+    if (o->quote == EXPORT_QUOTE_MINIMAL) {
+        for (size_t i = 0; i < len && !quote; i++) {
+            uint8_t c = v[i];
+            quote = c == o->delimiter || c == '"' || c == '\n' || c == '\r';
+        }
+    }
+    if (!quote) {
+        janet_buffer_push_bytes(buffer, v, len);
+        return;
+    }
+
+    janet_buffer_push_u8(buffer, '"');
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (v[i] == '"') {
+            janet_buffer_push_bytes(buffer, v + start, i + 1 - start);
+            start = i;
+        }
+    }
+    janet_buffer_push_bytes(buffer, v + start, len - start);
+    janet_buffer_push_u8(buffer, '"');
+}
+
+static Janet rows_export_chunk(int32_t argc, Janet *argv) {
+    janet_arity(argc, 3, 4);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    __ensure_rows_ok(rows);
+    JanetBuffer *buffer = janet_getbuffer(argv, 1);
+    jmy_export_opts_t o = export_opts(argv[2]);
+    bool header = argc > 3 && janet_truthy(argv[3]);
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+
+    if (header) {
+        for (int j = 0; j < num_fields; j++) {
+            if (j > 0) {
+                janet_buffer_push_u8(buffer, o.delimiter);
+            }
+            export_write_field(buffer, (uint8_t *)fields[j].name, strlen(fields[j].name), &o);
+        }
+        janet_buffer_push_u8(buffer, '\n');
+    }
+
+    bool more = true;
+    if (rows->statement == NULL) {
+        while (buffer->count < o.chunk_size) {
+            MYSQL_ROW row = mysql_fetch_row(rows->r);
+            if (row == NULL) {
+                more = false;
+                break;
+            }
+            unsigned long *lengths = mysql_fetch_lengths(rows->r);
+            for (int j = 0; j < num_fields; j++) {
+                if (j > 0) {
+                    janet_buffer_push_u8(buffer, o.delimiter);
+                }
+                if (row[j] == NULL) {
+                    janet_buffer_push_bytes(buffer, o.null.bytes, o.null.len);
+                } else {
+                    export_write_field(buffer, (uint8_t *)row[j], lengths[j], &o);
+                }
+            }
+            janet_buffer_push_u8(buffer, '\n');
+        }
+    } else {
+        jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+        if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+            stmt_panic(rows->statement, "mysql_stmt_bind_result");
+        }
+        while (buffer->count < o.chunk_size) {
+            if (!stmt_fetch_row(rows->statement, &binds)) {
+                more = false;
+                break;
+            }
+            for (int j = 0; j < num_fields; j++) {
+                MYSQL_BIND *bind = &binds.binds[j];
+                if (j > 0) {
+                    janet_buffer_push_u8(buffer, o.delimiter);
+                }
+                if (*bind->is_null || bind->buffer_type == MYSQL_TYPE_NULL) {
+                    janet_buffer_push_bytes(buffer, o.null.bytes, o.null.len);
+                    continue;
+                }
+                char buf[64];
+                int n = binary_text(bind, &fields[j], buf, sizeof(buf));
+                if (n < 0) {
+                    export_write_field(buffer, bind->buffer, *bind->length, &o);
+                } else {
+                    export_write_field(buffer, (uint8_t *)buf, n, &o);
+                }
+            }
+            janet_buffer_push_u8(buffer, '\n');
+        }
+        query_bind_free(binds);
+
+        if (!more) {
+            mysql_free_result(rows->r);
+            rows->r = NULL;
+        }
+    }
+
+    return janet_wrap_boolean(more);
+}
+
+static int count_subs(const char *q) {
+    int count = 0;
+    while (*q != '\0') {
+        if (*q == '?') {
+            count++;
+        }
+        q++;
+    }
+    return count;
+}
+
+static char *interpolate_params(MYSQL *conn, const char *q, size_t len, int32_t argc, Janet *argv) {
+    int n_subs = count_subs(q);
+    char **pvals = janet_smalloc(n_subs * sizeof(char *));
+    int *plengths = janet_smalloc(n_subs * sizeof(int));
+    if (n_subs != argc) {
+        janet_panicf("query: wrong arity %d expected got %d\n", n_subs, argc);
+    }
+
+    for (int i = 0; i < argc; i++) {
+        Janet j = argv[i];
+
+        switch (janet_type(j)) {
+            case JANET_NIL: {
+                const char *null = "NULL";
+                size_t len = strlen(null);
+                pvals[i] = janet_smalloc(len + 1);
+                strcpy(pvals[i], null);
+                plengths[i] = len;
+                break;
+            }
+
+            case JANET_BOOLEAN: {
+                pvals[i] = janet_smalloc(2);
+                plengths[i] = 1;
+                if (janet_unwrap_boolean(j)) {
+                    pvals[i][0] = '1';
+                } else {
+                    pvals[i][0] = '0';
+                }
+                pvals[i][1] = '\0';
+                break;
+            }
+
+            case JANET_BUFFER: {
+                JanetBuffer *b = janet_unwrap_buffer(j);
+                pvals[i] = janet_smalloc(b->count);
+                memcpy(pvals[i], b->data, b->count);
+                plengths[i] = b->count;
+                break;
+            }
+
+            case JANET_KEYWORD:
+            case JANET_STRING: {
+                const char *s = (char *)janet_unwrap_string(j);
+                size_t l = janet_string_length(s);
+                pvals[i] = janet_smalloc(l * 2 + 2 + 1);
+                pvals[i][0] = '\'';
+                unsigned long ol = mysql_real_escape_string_quote(conn, pvals[i] + 1, s, l, '\'');
+                pvals[i][1 + ol] = '\'';
+                plengths[i] = ol + 2;
+                break;
+            }
+
+            case JANET_NUMBER: {
+                double d = janet_unwrap_number(j);
+                /* The exact range could be increased to ~52 bits afaik, for now 32 bits
+                * only. */
+                const char *fmt = (d == floor(d) && d <= ((double)INT32_MAX) &&
+                                   d >= ((double)INT32_MIN))
+                                  ? "%.0f"
+                                  : "%g";
+                size_t l = snprintf(NULL, 0, fmt, d);
+                pvals[i] = janet_smalloc(l + 1);
+                snprintf(pvals[i], l + 1, fmt, d);
+                plengths[i] = l;
+                break;
+            }
+
+            case JANET_ABSTRACT: {
+                JanetIntType intt = janet_is_int(j);
+                if (intt == JANET_INT_S64) {
+                    int64_t v = janet_unwrap_s64(j);
+                    size_t l = snprintf(NULL, 0, "%" PRId64, v);
+                    pvals[i] = janet_smalloc(l + 1);
+                    snprintf(pvals[i], l + 1, "%" PRId64, v);
+                    plengths[i] = l;
+                    break;
+                } else if (intt == JANET_INT_U64) {
+                    uint64_t v = janet_unwrap_u64(j);
+                    size_t l = snprintf(NULL, 0, "%" PRIu64, v);
+                    pvals[i] = janet_smalloc(l + 1);
+                    snprintf(pvals[i], l + 1, "%" PRIu64, v);
+                    plengths[i] = l;
+                    break;
+                } else {
+                    /* fall-thru */
+                }
+            }
+            /* fall-thru */
+
+            default:
+                janet_panicf("cannot encode janet type %d", janet_type(j));
+        }
+    }
+
+    int total = 0;
+    for (int i = 0; i < argc; i++) {
+        total += plengths[i];
+    }
+    char *query = janet_smalloc(len + total + 1);
+    char *ps = query;
+    const char *pq = q;
+    int pi = 0;
+    while (*pq != '\0') {
+        if (*pq == '?') {
+            memcpy(ps, pvals[pi], plengths[pi]);
+            ps += plengths[pi];
+            pi++;
+        } else {
+            *ps++ = *pq;
+        }
+        pq++;
+    }
+
+    *ps = '\0';
+
+    /* Free in reverse order for sfree's sake */
+    for (int i = argc - 1; i > 0; i--) {
+        janet_sfree(pvals[i]);
+    }
+    janet_sfree(pvals);
+    janet_sfree(plengths);
+
+    return query;
+}
+
+static Janet snapshot_close(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_getabstract(argv, 0, &snapshot_type);
+    snapshot_gc(snap, sizeof(jmy_snapshot_t));
+    return janet_wrap_nil();
+}
+
+static JanetMethod snapshot_methods[] = {
+    {"close", snapshot_close}, /* So snapshots can be used with 'with' */
+    {NULL, NULL}
+};
+
+static int64_t snapshot_index(jmy_snapshot_t *snap, Janet key) {
+    __ensure_snapshot_ok(snap);
+    if (!janet_checkint64(key)) {
+        janet_panicf("expected integer row index, got %v", key);
+    }
+    int64_t i = (int64_t)janet_unwrap_number(key);
+    if (i < 0 || i >= snap->num_rows) {
+        janet_panicf("row index %v out of range [0,%d)", key, (int32_t)snap->num_rows);
+    }
+    return i;
+}
+
+static int snapshot_get(void *p, Janet key, Janet *out) {
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)p;
+    if (janet_checktype(key, JANET_KEYWORD)) {
+        return janet_getmethod(janet_unwrap_keyword(key), snapshot_methods, out);
+    }
+    if (!janet_checkint64(key)) {
+        return 0;
+    }
+    int64_t i = snapshot_index(snap, key);
+    jmy_row_t *row = (jmy_row_t *)janet_abstract(&row_type, sizeof(jmy_row_t));
+    row->rows = NULL;
+    row->snapshot = snap;
+    row->index = i;
+    *out = janet_wrap_abstract(row);
+    return 1;
+}
+
+static Janet snapshot_call(void *p, int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)p;
+    return snapshot_row_table(snap, snapshot_index(snap, argv[0]));
+}
+
+static Janet snapshot_next(void *p, Janet key) {
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)p;
+    int64_t n = (snap->base != NULL) ? snap->num_rows : 0;
+    int64_t i = janet_checktype(key, JANET_NIL) ? 0 : (int64_t)janet_unwrap_number(key) + 1;
+    return i < n ? janet_wrap_number((double)i) : janet_wrap_nil();
+}
+
+static size_t snapshot_length(void *p, size_t size) {
+    (void)size;
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)p;
+    __ensure_snapshot_ok(snap);
+    return (size_t)snap->num_rows;
+}
+
+/* Check that every section of the file lies inside it, returning what is
+ * wrong or NULL. */
+static const char *snapshot_check(jmy_snapshot_t *snap) {
+    if (snap->size < sizeof(jmy_snapshot_header_t)) {
+        return "too short";
+    }
+    const jmy_snapshot_header_t *h = (const jmy_snapshot_header_t *)snap->base;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))) {
+        return "bad magic";
+    }
+    if (h->version != SNAPSHOT_VERSION) {
+        return "unsupported version";
+    }
+    if (h->byte_order != SNAPSHOT_BYTE_ORDER) {
+        return "written with another byte order";
+    }
+    size_t size = snap->size;
+    uint64_t n = h->num_rows;
+    if (h->num_fields > (size - sizeof(jmy_snapshot_header_t)) / sizeof(jmy_snapshot_column_t)
+            || n > INT32_MAX) {
+        return "bad header";
+    }
+    const jmy_snapshot_column_t *columns = (const jmy_snapshot_column_t *)(snap->base + sizeof(jmy_snapshot_header_t));
+    for (uint32_t j = 0; j < h->num_fields; j++) {
+        const jmy_snapshot_column_t *c = &columns[j];
+        uint64_t values;
+        switch (c->storage) {
+            case SNAPSHOT_NUMBER:
+                values = n * sizeof(double);
+                break;
+            case SNAPSHOT_BOOLEAN:
+                values = n;
+                break;
+            case SNAPSHOT_STRING:
+            case SNAPSHOT_MARSHAL:
+                values = (n + 1) * sizeof(uint64_t);
+                break;
+            default:
+                return "unknown column storage";
+        }
+        if (c->name > size || c->name_length >= size - c->name || snap->base[c->name + c->name_length] != '\0'
+                || c->nulls > size || (n + 7) / 8 > size - c->nulls
+                || c->values > size || values > size - c->values || c->values % 8
+                || c->heap > size || c->heap_size > size - c->heap) {
+            return "column out of bounds";
+        }
+    }
+    snap->num_fields = (int)h->num_fields;
+    snap->num_rows = (int64_t)n;
+    snap->columns = columns;
+    return NULL;
+}
+
+static Janet snapshot_open(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *path = janet_getcstring(argv, 0);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        janet_panicf("could not open %s: %s", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int e = errno;
+        close(fd);
+        janet_panicf("could not stat %s: %s", path, strerror(e));
+    }
+    if ((size_t)st.st_size < sizeof(jmy_snapshot_header_t)) {
+        close(fd);
+        janet_panicf("%s is not a mysql/snapshot: too short", path);
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int e = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        janet_panicf("could not map %s: %s", path, strerror(e));
+    }
+
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_abstract(&snapshot_type, sizeof(jmy_snapshot_t));
+    memset(snap, 0, sizeof(jmy_snapshot_t));
+    snap->base = base;
+    snap->size = (size_t)st.st_size;
+    const char *problem = snapshot_check(snap);
+    if (problem != NULL) {
+        snapshot_gc(snap, sizeof(jmy_snapshot_t));
+        janet_panicf("%s is not a mysql/snapshot: %s", path, problem);
+    }
+    return janet_wrap_abstract(snap);
+}
+
+static Janet snapshot_column_values(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    jmy_snapshot_t *snap = (jmy_snapshot_t *)janet_getabstract(argv, 0, &snapshot_type);
+    __ensure_snapshot_ok(snap);
+    int j = snapshot_field_index(snap, argv[1]);
+    if (j < 0) {
+        janet_panicf("no column %v", argv[1]);
+    }
+    return snapshot_column(snap, j);
+}
+
+/* The storage for a column of decoded values: the kind they all share, or
+ * marshalled values when they differ. */
+static uint32_t snapshot_storage(JanetArray *a) {
+    int storage = -1;
+    for (int32_t i = 0; i < a->count; i++) {
+        int s;
+        switch (janet_type(a->data[i])) {
+            case JANET_NIL:
+                continue;
+            case JANET_NUMBER:
+                s = SNAPSHOT_NUMBER;
+                break;
+            case JANET_BOOLEAN:
+                s = SNAPSHOT_BOOLEAN;
+                break;
+            case JANET_STRING:
+                s = SNAPSHOT_STRING;
+                break;
+            default:
+                return SNAPSHOT_MARSHAL;
+        }
+        if (storage >= 0 && s != storage) {
+            return SNAPSHOT_MARSHAL;
+        }
+        storage = s;
+    }
+    return storage < 0 ? SNAPSHOT_NUMBER : (uint32_t)storage;
+}
+
+/* Write a section padded to 8 bytes, returning its offset. */
+static uint64_t snapshot_write(FILE *f, uint64_t *offset, const void *data, size_t n) {
+    static const uint8_t zeros[8] = {0};
+    uint64_t at = *offset;
+    size_t pad = (8 - n % 8) % 8;
+    if (n > 0) {
+        fwrite(data, 1, n, f);
+    }
+    fwrite(zeros, 1, pad, f);
+    *offset += n + pad;
+    return at;
+}
+
+static Janet rows_save(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    jmy_rows_t *rows = (jmy_rows_t *)janet_getabstract(argv, 0, &rows_type);
+    const char *path = janet_getcstring(argv, 1);
+    __ensure_rows_ok(rows);
+
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    JanetArray **cols = janet_smalloc(sizeof(JanetArray *) * num_fields);
+    for (int j = 0; j < num_fields; j++) {
+        cols[j] = janet_array(0);
+    }
+    rows_fill_columns(rows, cols, 1);
+    int64_t n = num_fields > 0 ? cols[0]->count : 0;
+
+    /* Readers only ever see a complete file, the old one or the new one. */
+    size_t path_len = strlen(path);
+    char *tmp = janet_smalloc(path_len + 5);
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", 5);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        janet_sfree(tmp);
+        janet_sfree(cols);
+        janet_panicf("could not create %s: %s", path, strerror(errno));
+    }
+
+    jmy_snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.num_fields = num_fields;
+    header.num_rows = n;
+    jmy_snapshot_column_t *columns = janet_smalloc(sizeof(jmy_snapshot_column_t) * (num_fields + 1));
+    memset(columns, 0, sizeof(jmy_snapshot_column_t) * (num_fields + 1));
+
+    /* The header and columns are rewritten once the offsets are known. */
+    uint64_t offset = 0;
+    snapshot_write(f, &offset, &header, sizeof(header));
+    snapshot_write(f, &offset, columns, sizeof(jmy_snapshot_column_t) * num_fields);
+
+    JanetBuffer *values = janet_buffer(0);
+    JanetBuffer *heap = janet_buffer(0);
+    JanetBuffer *nulls = janet_buffer(0);
+    for (int j = 0; j < num_fields; j++) {
+        jmy_snapshot_column_t *c = &columns[j];
+        JanetArray *a = cols[j];
+        c->type = fields[j].type;
+        c->flags = fields[j].flags;
+        c->decimals = fields[j].decimals;
+        c->charsetnr = fields[j].charsetnr;
+        c->length = fields[j].length;
+        c->storage = snapshot_storage(a);
+        c->name_length = strlen(fields[j].name);
+        c->name = snapshot_write(f, &offset, fields[j].name, c->name_length + 1);
+
+        janet_buffer_setcount(values, 0);
+        janet_buffer_setcount(heap, 0);
+        janet_buffer_setcount(nulls, (int32_t)((n + 7) / 8));
+        memset(nulls->data, 0, nulls->count);
+        uint64_t heap_offset = 0;
+        for (int64_t i = 0; i <= n; i++) {
+            if (c->storage == SNAPSHOT_STRING || c->storage == SNAPSHOT_MARSHAL) {
+                heap_offset = heap->count;
+                janet_buffer_push_bytes(values, (const uint8_t *)&heap_offset, sizeof(heap_offset));
+            }
+            if (i == n) {
+                break;
+            }
+            Janet v = a->data[i];
+            if (janet_checktype(v, JANET_NIL)) {
+                nulls->data[i / 8] |= 1 << (i % 8);
+            }
+            switch (c->storage) {
+                case SNAPSHOT_NUMBER: {
+                    double d = janet_checktype(v, JANET_NUMBER) ? janet_unwrap_number(v) : 0;
+                    janet_buffer_push_bytes(values, (const uint8_t *)&d, sizeof(d));
+                    break;
+                }
+                case SNAPSHOT_BOOLEAN:
+                    janet_buffer_push_u8(values, janet_truthy(v));
+                    break;
+                case SNAPSHOT_STRING:
+                    if (janet_checktype(v, JANET_STRING)) {
+                        const uint8_t *s = janet_unwrap_string(v);
+                        janet_buffer_push_bytes(heap, s, janet_string_length(s));
+                    }
+                    break;
+                default:
+                    if (!janet_checktype(v, JANET_NIL)) {
+                        janet_marshal(heap, v, NULL, 0);
+                    }
+                    break;
+            }
+        }
+        c->nulls = snapshot_write(f, &offset, nulls->data, nulls->count);
+        c->values = snapshot_write(f, &offset, values->data, values->count);
+        c->heap = snapshot_write(f, &offset, heap->data, heap->count);
+        c->heap_size = heap->count;
+    }
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&header, 1, sizeof(header), f);
+    fwrite(columns, 1, sizeof(jmy_snapshot_column_t) * num_fields, f);
+    bool failed = ferror(f) != 0;
+    failed = fclose(f) != 0 || failed;
+    janet_sfree(columns);
+    janet_sfree(cols);
+    if (failed || rename(tmp, path) != 0) {
+        int e = errno;
+        remove(tmp);
+        janet_sfree(tmp);
+        janet_panicf("could not write %s: %s", path, strerror(e));
+    }
+    janet_sfree(tmp);
+    return janet_wrap_nil();
+}
+
+static const char commit_sql[] = ";commit";
+
+/* Send query without waiting for its result, returning false on failure.
+ * It is prefixed with the start transaction of a lazily begun transaction
+ * and optionally followed by a commit, so they share one round trip, which
+ * needs a multi statements connection, see text_query_begin.
+ * *begin is set if the pending begin statements went out with it. */
+static bool text_query_send(jmy_context_t *ctx, const char *query, bool commit, bool *begin_sent) {
+    size_t len = strlen(query);
+    bool begin = ctx->begin_pending;
+    char *sql = (char *)query;
+    if (begin || commit) {
+        if (commit) {
+            while (len > 0 && (query[len - 1] == ';' || isspace((unsigned char)query[len - 1]))) {
+                len--;
+            }
+        }
+        size_t begin_len = begin ? strlen(ctx->begin_sql) : 0;
+        size_t commit_len = commit ? strlen(commit_sql) : 0;
+        sql = janet_smalloc(begin_len + len + commit_len + 1);
+        memcpy(sql, ctx->begin_sql, begin_len);
+        memcpy(sql + begin_len, query, len);
+        memcpy(sql + begin_len + len, commit_sql, commit_len);
+        len += begin_len + commit_len;
+        sql[len] = '\0';
+    }
+
+    ctx->begin_pending = false;
+    int failed = mysql_send_query(ctx->conn, sql, len);
+    if (sql != query) {
+        janet_sfree(sql);
+    }
+    *begin_sent = begin;
+    return !failed;
+}
+
+/* Read the result of a sent query, stepping over the status results of
+ * any begin statements in front of it. Returns false on failure. */
+static bool text_query_read(jmy_context_t *ctx, bool begin_sent) {
+    if (mysql_read_query_result(ctx->conn)) {
+        return false;
+    }
+    if (begin_sent) {
+        for (const char *p = ctx->begin_sql; *p != '\0'; p++) {
+            if (*p == ';' && mysql_next_result(ctx->conn) > 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Without multi statements a pending begin can't share the query's round
+ * trip, so it is sent before the query is armed. */
+static void text_query_begin(jmy_context_t *ctx) {
+    if (ctx->begin_pending && !ctx->multi_statements) {
+        begin_i(ctx);
+    }
+}
+
+/* On return the connection is positioned on the result of query itself.
+ * A commit that couldn't go along with it is left to the caller. */
+static void text_query(jmy_context_t *ctx, const char *query, bool commit) {
+    text_query_begin(ctx);
+    double timeout = query_timeout();
+    char *hinted = timeout > 0 ? hint_select(query, timeout) : NULL;
+    jmy_watchdog_t *w = watchdog_arm(ctx, hinted != NULL ? timeout + TIMEOUT_GRACE : timeout);
+    bool begin_sent;
+    bool ok = text_query_send(ctx, hinted != NULL ? hinted : query, commit && ctx->multi_statements, &begin_sent) &&
+              text_query_read(ctx, begin_sent);
+    bool fired = watchdog_disarm(w);
+    if (hinted != NULL) {
+        janet_sfree(hinted);
+    }
+    if (!ok) {
+        if (fired || mysql_errno(ctx->conn) == JMY_QUERY_TIMEOUT) {
+            timeout_panic(timeout);
+        }
+        conn_panic(ctx->conn, "mysql_real_query");
     }
-    janet_panicf("error: bad slot #0, expected mysql/connection or mysql/stmt, got %v", argv[0]);
-    return janet_wrap_nil();
 }
 
-static Janet context_select(int32_t argc, Janet *argv) {
+static Janet text_exec(jmy_context_t *ctx, int32_t argc, Janet *argv, bool commit) {
+    const char *q = janet_getcstring(argv, 0);
+    int len = strlen(q);
+
+    argc -= 1;
+    argv += 1;
+
+    char *query = interpolate_params(ctx->conn, q, len, argc, argv);
+    text_query(ctx, query, commit);
+    janet_sfree(query);
+
+    /* the column count is > 0 if there is a result set */
+    /* 0 if the result is only the final status packet */
+    int num_fields = mysql_field_count(ctx->conn);
+    if (num_fields > 0) {
+        janet_panicf("mysql_field_count unexpected returned 0\n");
+    }
+
+    jmy_result_t *result = (jmy_result_t *)janet_abstract(&result_type, sizeof(jmy_result_t));
+    result->affected_rows = mysql_affected_rows(ctx->conn);
+    result->insert_id = mysql_insert_id(ctx->conn);
+
+    drain_results(ctx->conn);
+    if (commit) {
+        if (!ctx->multi_statements && mysql_commit(ctx->conn)) {
+            conn_panic(ctx->conn, "mysql_commit");
+        }
+        ctx->in_transaction = false;
+    }
+    return janet_wrap_abstract(result);
+}
+
+static Janet text_rows_wrap(jmy_context_t *ctx, MYSQL_RES *r, int num_fields, bool buffered) {
+    jmy_rows_t *rows = (jmy_rows_t *)janet_abstract(&rows_type, sizeof(jmy_rows_t));
+    rows->num_fields = num_fields;
+    rows->r = r;
+    rows->statement = NULL;
+    rows->buffered = buffered;
+    rows->owner = janet_wrap_abstract(ctx);
+    rows->execution = 0;
+    rows->prefetch = NULL;
+    rows->decoders = NULL;
+    rows->decoders = resolve_decoders(mysql_fetch_fields(r), num_fields);
+    rows_gcpressure(rows);
+    return janet_wrap_abstract(rows);
+}
+
+/* Wrap the result of the query just read on ctx as mysql/rows. */
+static Janet text_rows(jmy_context_t *ctx, bool buffered) {
+    int num_fields = mysql_field_count(ctx->conn);
+    if (num_fields == 0) {
+        janet_panicf("mysql_field_count unexpected returned 0\n");
+    }
+
+    MYSQL_RES *r = buffered ? mysql_store_result(ctx->conn) : mysql_use_result(ctx->conn);
+    if (r == NULL) {
+        conn_panic(ctx->conn, buffered ? "mysql_store_result" : "mysql_use_result");
+    }
+    Janet rows = text_rows_wrap(ctx, r, num_fields, buffered);
+
+    /* Unbuffered rows must be read before any further results. */
+    if (buffered) {
+        drain_results(ctx->conn);
+    }
+    return rows;
+}
+
+static Janet text_select(jmy_context_t *ctx, int32_t argc, Janet *argv, bool buffered) {
+    const char *q = janet_getcstring(argv, 1);
+    int len = strlen(q);
+
+    argc -= 2;
+    argv += 2;
+
+    char *query = interpolate_params(ctx->conn, q, len, argc, argv);
+    text_query(ctx, query, false);
+    janet_sfree(query);
+
+    return text_rows(ctx, buffered);
+}
+
+/* Send the same select on every connection before reading any result, so
+ * the servers run it at the same time. */
+/* Interpolate q for each of ctxs into queries, with a MAX_EXECUTION_TIME
+ * hint when there is a timeout. Returns the seconds to arm watchdogs for. */
+static double hinted_queries(jmy_context_t **ctxs, char **queries, int32_t n, const char *q, int len,
+                             int32_t argc, Janet *argv, double timeout) {
+    bool hinted = false;
+    for (int32_t i = 0; i < n; i++) {
+        queries[i] = interpolate_params(ctxs[i]->conn, q, len, argc, argv);
+        char *with_hint = timeout > 0 ? hint_select(queries[i], timeout) : NULL;
+        if (with_hint != NULL) {
+            janet_sfree(queries[i]);
+            queries[i] = with_hint;
+            hinted = true;
+        }
+    }
+    return hinted ? timeout + TIMEOUT_GRACE : timeout;
+}
+
+static Janet context_select_concurrent(int32_t argc, Janet *argv) {
+    if (argc < 2) {
+        janet_panic("expected at least connections and a query string");
+    }
+    JanetView conns = janet_getindexed(argv, 0);
+    const char *q = janet_getcstring(argv, 1);
+    int len = strlen(q);
+
+    jmy_context_t **ctxs = janet_smalloc(sizeof(jmy_context_t *) * (conns.len + 1));
+    bool *begin_sent = janet_smalloc(sizeof(bool) * (conns.len + 1));
+    char **queries = janet_smalloc(sizeof(char *) * (conns.len + 1));
+    jmy_watchdog_t **dogs = janet_smalloc(sizeof(jmy_watchdog_t *) * (conns.len + 1));
+    for (int32_t i = 0; i < conns.len; i++) {
+        ctxs[i] = (jmy_context_t *)janet_getabstract(conns.items, i, &context_type);
+        __ensure_ctx_ok(ctxs[i]);
+        text_query_begin(ctxs[i]);
+    }
+    double timeout = query_timeout();
+    double watch = hinted_queries(ctxs, queries, conns.len, q, len, argc - 2, argv + 2, timeout);
+
+    int32_t sent = 0;
+    for (; sent < conns.len; sent++) {
+        dogs[sent] = watchdog_arm(ctxs[sent], watch);
+        if (!text_query_send(ctxs[sent], queries[sent], false, &begin_sent[sent])) {
+            watchdog_disarm(dogs[sent]);
+            break;
+        }
+    }
+
+    /* Every sent query is read, even after a failure, so no connection is
+     * left with a result waiting. The first error is raised at the end. */
+    Janet err = janet_wrap_nil();
+    if (sent < conns.len) {
+        MYSQL *conn = ctxs[sent]->conn;
+        err = make_error("mysql_send_query", mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn));
+    }
+    JanetArray *a = janet_array(sent);
+    for (int32_t i = 0; i < sent; i++) {
+        MYSQL *conn = ctxs[i]->conn;
+        const char *where = "mysql_read_query_result";
+        MYSQL_RES *r = NULL;
+        if (text_query_read(ctxs[i], begin_sent[i])) {
+            where = "mysql_store_result";
+            r = mysql_store_result(conn);
+        }
+        bool fired = watchdog_disarm(dogs[i]);
+        if (r != NULL) {
+            janet_array_push(a, text_rows_wrap(ctxs[i], r, mysql_num_fields(r), true));
+        } else if (janet_checktype(err, JANET_NIL)) {
+            if (fired || mysql_errno(conn) == JMY_QUERY_TIMEOUT) {
+                err = timeout_error(timeout);
+            } else {
+                err = mysql_errno(conn)
+                      ? make_error(where, mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn))
+                      : janet_cstringv("select-concurrent query returned no rows");
+            }
+        }
+        while (mysql_next_result(conn) == 0) {
+            MYSQL_RES *extra = mysql_store_result(conn);
+            if (extra != NULL) {
+                mysql_free_result(extra);
+            }
+        }
+    }
+    for (int32_t i = 0; i < conns.len; i++) {
+        janet_sfree(queries[i]);
+    }
+    janet_sfree(dogs);
+    janet_sfree(queries);
+    janet_sfree(begin_sent);
+    janet_sfree(ctxs);
+
+    if (!janet_checktype(err, JANET_NIL)) {
+        janet_panicv(err);
+    }
+    return janet_wrap_array(a);
+}
+
+/* Send a select to the first connection, and to each next one whenever
+ * delay seconds pass without any answer. The first connection to answer
+ * wins and is returned at once. The query is killed on the others, whose
+ * results are discarded when each connection is next used. Waiting is a
+ * poll on the sockets, the client library has no portable nonblocking
+ * calls. */
+static Janet context_select_hedged(int32_t argc, Janet *argv) {
+    if (argc < 3) {
+        janet_panic("expected at least connections, a delay and a query string");
+    }
+    JanetView conns = janet_getindexed(argv, 0);
+    if (conns.len < 1) {
+        janet_panic("expected at least one connection");
+    }
+    double delay = janet_getnumber(argv, 1);
+    const char *q = janet_getcstring(argv, 2);
+    int len = strlen(q);
+
+    /* Everything that can fail before a query is sent is done first. */
+    jmy_context_t **ctxs = janet_smalloc(sizeof(jmy_context_t *) * conns.len);
+    char **queries = janet_smalloc(sizeof(char *) * conns.len);
+    for (int32_t i = 0; i < conns.len; i++) {
+        ctxs[i] = (jmy_context_t *)janet_getabstract(conns.items, i, &context_type);
+        __ensure_ctx_ok(ctxs[i]);
+        if (ctxs[i]->in_transaction || ctxs[i]->begin_pending) {
+            janet_panic("hedged selects can't run in a transaction");
+        }
+    }
+    double timeout = query_timeout();
+    double watch = hinted_queries(ctxs, queries, conns.len, q, len, argc - 3, argv + 3, timeout);
+
+    struct pollfd *fds = janet_smalloc(sizeof(struct pollfd) * conns.len);
+    jmy_watchdog_t **dogs = janet_smalloc(sizeof(jmy_watchdog_t *) * conns.len);
+    Janet err = janet_wrap_nil();
+    int32_t sent = 0, pending = 0, winner = -1;
+    while (winner < 0 && (pending > 0 || sent < conns.len)) {
+        if (sent < conns.len) {
+            bool begin_sent;
+            fds[sent].fd = -1;
+            fds[sent].events = POLLIN;
+            fds[sent].revents = 0;
+            dogs[sent] = watchdog_arm(ctxs[sent], watch);
+            if (text_query_send(ctxs[sent], queries[sent], false, &begin_sent)) {
+                fds[sent].fd = ctxs[sent]->conn->net.fd;
+                pending++;
+            } else {
+                watchdog_disarm(dogs[sent]);
+                dogs[sent] = NULL;
+                if (janet_checktype(err, JANET_NIL)) {
+                    MYSQL *conn = ctxs[sent]->conn;
+                    err = make_error("mysql_send_query", mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn));
+                }
+            }
+            sent++;
+        }
+        if (pending == 0) {
+            continue;
+        }
+        int timeout = sent < conns.len ? (int)(delay * 1000) : -1;
+        int ready = poll(fds, sent, timeout);
+        if (ready < 0 && errno != EINTR) {
+            /* Fall back to waiting on the first query sent. */
+            for (int32_t i = 0; i < sent && winner < 0; i++) {
+                if (fds[i].fd >= 0) {
+                    winner = i;
+                }
+            }
+        }
+        for (int32_t i = 0; i < sent && winner < 0 && ready > 0; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents != 0) {
+                winner = i;
+            }
+        }
+    }
+
+    Janet rows = janet_wrap_nil();
+    if (winner >= 0) {
+        MYSQL *conn = ctxs[winner]->conn;
+        const char *where = "mysql_read_query_result";
+        MYSQL_RES *r = NULL;
+        if (text_query_read(ctxs[winner], false)) {
+            where = "mysql_store_result";
+            r = mysql_store_result(conn);
+        }
+        bool fired = watchdog_disarm(dogs[winner]);
+        if (r != NULL) {
+            rows = text_rows_wrap(ctxs[winner], r, mysql_num_fields(r), true);
+            err = janet_wrap_nil();
+        } else if (fired || mysql_errno(conn) == JMY_QUERY_TIMEOUT) {
+            err = timeout_error(timeout);
+        } else {
+            err = mysql_errno(conn)
+                  ? make_error(where, mysql_errno(conn), mysql_sqlstate(conn), mysql_error(conn))
+                  : janet_cstringv("select-hedged query returned no rows");
+        }
+        while (mysql_next_result(conn) == 0) {
+            MYSQL_RES *extra = mysql_store_result(conn);
+            if (extra != NULL) {
+                mysql_free_result(extra);
+            }
+        }
+    }
+
+    /* The losers are killed unless already answering. A loser whose kill
+     * failed runs to the end, and its next use waits for that. */
+    int32_t kill_failures = 0;
+    for (int32_t i = 0; i < sent; i++) {
+        if (i == winner || fds[i].fd < 0) {
+            continue;
+        }
+        struct pollfd one = fds[i];
+        if (poll(&one, 1, 0) <= 0 && !kill_query(&ctxs[i]->credentials, ctxs[i]->thread_id)) {
+            kill_failures++;
+        }
+        watchdog_disarm(dogs[i]);
+        ctxs[i]->draining = true;
+    }
+
+    for (int32_t i = 0; i < conns.len; i++) {
+        janet_sfree(queries[i]);
+    }
+    janet_sfree(dogs);
+    janet_sfree(fds);
+    janet_sfree(queries);
+    janet_sfree(ctxs);
+
+    if (!janet_checktype(err, JANET_NIL)) {
+        janet_panicv(err);
+    }
+    Janet result[4] = {rows, janet_wrap_integer(winner), janet_wrap_integer(sent),
+                       janet_wrap_integer(kill_failures)};
+    return janet_wrap_tuple(janet_tuple_n(result, 4));
+}
+
+static Janet context_exec(int32_t argc, Janet *argv) {
+    if (argc < 2) {
+        janet_panic("expected at least a pq context and a query string");
+    }
+    if (argc > 10000000) {
+        janet_panic("too many arguments");
+    }
+
+    if (janet_checkabstract(argv[0], &context_type)) {
+        jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+        __ensure_ctx_ok(ctx);
+        argc -= 1;
+        argv += 1;
+        return text_exec(ctx, argc, argv, false);
+    }
+
+    if (janet_checkabstract(argv[0], &statement_type)) {
+        jmy_statement_t *stmt = (jmy_statement_t *)janet_getabstract(argv, 0, &statement_type);
+        __ensure_stmt_ok(stmt);
+        argc -= 1;
+        argv += 1;
+        return stmt_exec(stmt, argc, argv);
+    }
+    janet_panicf("error: bad slot #0, expected mysql/connection or mysql/stmt, got %v", argv[0]);
+    return janet_wrap_nil();
+}
+
+static Janet select_i(int32_t argc, Janet *argv, bool buffered) {
     if (argc < 2) {
         janet_panic("expected at least a pq context and a query string");
     }
@@ -1197,84 +4877,890 @@ static Janet context_select(int32_t argc, Janet *argv) {
     if (janet_checkabstract(argv[0], &context_type)) {
         jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
         __ensure_ctx_ok(ctx);
-        return text_select(ctx, argc, argv);
+        return text_select(ctx, argc, argv, buffered);
+    }
+    if (janet_checkabstract(argv[0], &statement_type)) {
+        jmy_statement_t *stmt = (jmy_statement_t *)janet_getabstract(argv, 0, &statement_type);
+        __ensure_stmt_ok(stmt);
+        return stmt_select(stmt, argc, argv, buffered);
+    }
+    janet_panicf("error: bad slot #0, expected mysql/connection or mysql/stmt, got %v", argv[0]);
+    return janet_wrap_nil();
+}
+
+static Janet context_select(int32_t argc, Janet *argv) {
+    return select_i(argc, argv, true);
+}
+
+static Janet context_select_unbuffered(int32_t argc, Janet *argv) {
+    return select_i(argc, argv, false);
+}
+
+/* The row, val and col helpers read rows as they arrive and decode only
+ * what they return. */
+typedef enum {
+    FAST_ROW,
+    FAST_VAL,
+    FAST_COL
+} jmy_fast_t;
+
+static Janet fast_select(int32_t argc, Janet *argv, jmy_fast_t mode) {
+    jmy_rows_t *rows = (jmy_rows_t *)janet_unwrap_abstract(select_i(argc, argv, false));
+    int num_fields = rows->num_fields;
+    MYSQL_FIELD *fields = mysql_fetch_fields(rows->r);
+    JanetArray *a = mode == FAST_COL ? janet_array(0) : NULL;
+    Janet result = janet_wrap_nil();
+
+    if (rows->statement == NULL) {
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(rows->r)) != NULL) {
+            unsigned long *lengths = mysql_fetch_lengths(rows->r);
+            if (mode == FAST_ROW) {
+                result = text_row_table(row, lengths, num_fields, fields, rows->decoders);
+                break;
+            }
+            Janet jv = decode_text_with(&rows->decoders[0], row[0], lengths[0], &fields[0]);
+            if (mode == FAST_VAL) {
+                result = jv;
+                break;
+            }
+            janet_array_push(a, jv);
+        }
+    } else {
+        jmy_query_bind_t binds = allocate_binds(num_fields, fields);
+        if (mysql_stmt_bind_result(rows->statement, binds.binds)) {
+            stmt_panic(rows->statement, "mysql_stmt_bind_result");
+        }
+        while (stmt_fetch_row(rows->statement, &binds)) {
+            if (mode == FAST_ROW) {
+                result = binary_row_table(&binds, num_fields, fields, rows->decoders);
+                break;
+            }
+            Janet jv = decode_binary_with(&rows->decoders[0], &binds.binds[0], &fields[0]);
+            if (mode == FAST_VAL) {
+                result = jv;
+                break;
+            }
+            janet_array_push(a, jv);
+        }
+        query_bind_free(binds);
+        /* Discard any rows we didn't read. */
+        mysql_stmt_free_result(rows->statement);
+    }
+
+    mysql_free_result(rows->r);
+    rows->r = NULL;
+    return mode == FAST_COL ? janet_wrap_array(a) : result;
+}
+
+static Janet context_row(int32_t argc, Janet *argv) {
+    return fast_select(argc, argv, FAST_ROW);
+}
+
+static Janet context_val(int32_t argc, Janet *argv) {
+    return fast_select(argc, argv, FAST_VAL);
+}
+
+static Janet context_col(int32_t argc, Janet *argv) {
+    return fast_select(argc, argv, FAST_COL);
+}
+
+
+static Janet context_status(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    __ensure_ctx_ok(ctx);
+    return janet_wrap_integer(mysql_ping(ctx->conn));
+}
+
+static Janet context_close(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    if (ctx->conn == NULL) {
+        janet_panic("mysql/context is disconnected");
+    }
+    context_close_i(ctx);
+    return janet_wrap_nil();
+}
+
+static Janet context_begin(int32_t argc, Janet *argv) {
+    janet_arity(argc, 1, 3);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    __ensure_ctx_ok(ctx);
+
+    const char *sql = janet_optcstring(argv, argc, 2, "start transaction");
+    size_t len = strlen(sql);
+    while (len > 0 && (sql[len - 1] == ';' || isspace((unsigned char)sql[len - 1]))) {
+        len--;
+    }
+    if (len + 2 > sizeof(ctx->begin_sql)) {
+        janet_panic("begin statement too long");
+    }
+    memcpy(ctx->begin_sql, sql, len);
+    ctx->begin_sql[len] = ';';
+    ctx->begin_sql[len + 1] = '\0';
+
+    /* A lazy begin is sent along with the first statement of the transaction. */
+    if (argc > 1 && janet_truthy(argv[1])) {
+        ctx->begin_pending = true;
+        ctx->in_transaction = true;
+        return janet_wrap_nil();
+    }
+    begin_i(ctx);
+    return janet_wrap_nil();
+}
+
+static Janet context_commit(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    __ensure_ctx_ok(ctx);
+
+    if (!ctx->begin_pending && mysql_commit(ctx->conn)) {
+        conn_panic(ctx->conn, "mysql_commit");
+    }
+    ctx->begin_pending = false;
+    ctx->in_transaction = false;
+    return janet_wrap_nil();
+}
+
+static Janet context_rollback(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    __ensure_ctx_ok(ctx);
+
+    if (!ctx->begin_pending && mysql_rollback(ctx->conn)) {
+        conn_panic(ctx->conn, "mysql_rollback");
+    }
+    ctx->begin_pending = false;
+    ctx->in_transaction = false;
+    return janet_wrap_nil();
+}
+
+static Janet context_exec_commit(int32_t argc, Janet *argv) {
+    if (argc < 2) {
+        janet_panic("expected at least a mysql context and a query string");
+    }
+
+    if (janet_checkabstract(argv[0], &context_type)) {
+        jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+        __ensure_ctx_ok(ctx);
+        return text_exec(ctx, argc - 1, argv + 1, true);
     }
+
+    /* Statements can't share a round trip with the commit. */
     if (janet_checkabstract(argv[0], &statement_type)) {
         jmy_statement_t *stmt = (jmy_statement_t *)janet_getabstract(argv, 0, &statement_type);
         __ensure_stmt_ok(stmt);
-        return stmt_select(stmt, argc, argv);
+        Janet result = stmt_exec(stmt, argc - 1, argv + 1);
+        if (mysql_commit(stmt->ctx->conn)) {
+            conn_panic(stmt->ctx->conn, "mysql_commit");
+        }
+        stmt->ctx->in_transaction = false;
+        return result;
+    }
+    janet_panicf("error: bad slot #0, expected mysql/connection or mysql/stmt, got %v", argv[0]);
+    return janet_wrap_nil();
+}
+
+static Janet context_reset_connection(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    __ensure_ctx_ok(ctx);
+    /* Any transaction is rolled back and every statement closed, even if
+     * the reset fails part way. */
+    ctx->in_transaction = false;
+    ctx->begin_pending = false;
+    ctx->resets++;
+    if (mysql_reset_connection(ctx->conn)) {
+        conn_panic(ctx->conn, "mysql_reset_connection");
     }
-    janet_panicf("error: bad slot #0, expected mysql/connection or mysql/stmt, got %v", argv[0]);
     return janet_wrap_nil();
 }
 
-
-static Janet context_status(int32_t argc, Janet *argv) {
+static Janet context_in_transaction(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 1);
     jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
     __ensure_ctx_ok(ctx);
-    return janet_wrap_integer(mysql_ping(ctx->conn));
+    return janet_wrap_boolean(ctx->in_transaction);
 }
 
-static Janet context_close(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
+static Janet context_autocommit(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 2);
     jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
     __ensure_ctx_ok(ctx);
-    context_close_i(ctx);
+    bool ok = janet_getboolean(argv, 1);
+    if (mysql_autocommit(ctx->conn, ok)) {
+        conn_panic(ctx->conn, "mysql_commit");
+    }
     return janet_wrap_nil();
 }
 
-static Janet context_begin(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
-    __ensure_ctx_ok(ctx);
+/* Binlog change data capture. The connection registers as a replica and
+ * streams row based events, which are decoded into the same values the
+ * binary protocol produces by handing decode_binary a MYSQL_BIND. */
+
+#define BINLOG_QUERY_EVENT 2
+#define BINLOG_ROTATE_EVENT 4
+#define BINLOG_XID_EVENT 16
+#define BINLOG_TABLE_MAP_EVENT 19
+#define BINLOG_WRITE_ROWS_V1 23
+#define BINLOG_UPDATE_ROWS_V1 24
+#define BINLOG_DELETE_ROWS_V1 25
+#define BINLOG_WRITE_ROWS_V2 30
+#define BINLOG_UPDATE_ROWS_V2 31
+#define BINLOG_DELETE_ROWS_V2 32
+#define BINLOG_HEADER_SIZE 19
+#define BINLOG_DUMP_NON_BLOCK 1
+
+typedef struct {
+    jmy_context_t *ctx;
+    MYSQL_RPL rpl;
+    char file[512];
+    /* Where the last transaction ended, the only safe place to resume. */
+    char safe_file[512];
+    uint64_t safe_position;
+    bool open;
+    /* Events end in a CRC32 when the server's binlog_checksum is set. */
+    bool checksum;
+    /* Table id to the last table map event for it. */
+    JanetTable *maps;
+} jmy_binlog_t;
+
+static int binlog_gcmark(void *p, size_t s) {
+    (void)s;
+    jmy_binlog_t *b = (jmy_binlog_t *)p;
+    janet_mark(janet_wrap_abstract(b->ctx));
+    janet_mark(janet_wrap_table(b->maps));
+    return 0;
+}
+
+static const JanetAbstractType binlog_type = {
+    "mysql/binlog",
+    NULL,
+    binlog_gcmark,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} jmy_cursor_t;
 
-    const char *start = "start transaction";
-    if (mysql_real_query(ctx->conn, start, strlen(start))) {
-        janet_panicf("mysql_real_query failed %s\n", mysql_error(ctx->conn));
+static const uint8_t *cursor_take(jmy_cursor_t *c, size_t n) {
+    if ((size_t)(c->end - c->p) < n) {
+        janet_panic("truncated binlog event");
     }
-    ctx->in_transaction = true;
-    return janet_wrap_nil();
+    const uint8_t *p = c->p;
+    c->p += n;
+    return p;
 }
 
-static Janet context_commit(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
-    __ensure_ctx_ok(ctx);
+static uint64_t cursor_le(jmy_cursor_t *c, int n) {
+    const uint8_t *p = cursor_take(c, n);
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
 
-    if (mysql_commit(ctx->conn)) {
-        janet_panicf("mysql_commit failed %s\n", mysql_error(ctx->conn));
+static uint64_t cursor_be(jmy_cursor_t *c, int n) {
+    const uint8_t *p = cursor_take(c, n);
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v = (v << 8) | p[i];
     }
-    ctx->in_transaction = false;
-    return janet_wrap_nil();
+    return v;
 }
 
-static Janet context_rollback(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
-    __ensure_ctx_ok(ctx);
+static uint64_t cursor_lenenc(jmy_cursor_t *c) {
+    uint8_t first = *cursor_take(c, 1);
+    switch (first) {
+        case 252:
+            return cursor_le(c, 2);
+        case 253:
+            return cursor_le(c, 3);
+        case 254:
+            return cursor_le(c, 8);
+        default:
+            return first;
+    }
+}
+
+static bool bitmap_get(const uint8_t *bitmap, int i) {
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+/* Bytes of metadata each column type carries in a table map event. */
+static int binlog_meta_size(int type) {
+    switch (type) {
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_BLOB:
+        case MYSQL_TYPE_GEOMETRY:
+        case MYSQL_TYPE_JSON:
+        case MYSQL_TYPE_TIMESTAMP2:
+        case MYSQL_TYPE_DATETIME2:
+        case MYSQL_TYPE_TIME2:
+            return 1;
+        case MYSQL_TYPE_VARCHAR:
+        case MYSQL_TYPE_VAR_STRING:
+        case MYSQL_TYPE_BIT:
+        case MYSQL_TYPE_NEWDECIMAL:
+        case MYSQL_TYPE_STRING:
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET:
+            return 2;
+        default:
+            return 0;
+    }
+}
 
-    if (mysql_rollback(ctx->conn)) {
-        janet_panicf("mysql_rollback failed %s\n", mysql_error(ctx->conn));
+static bool binlog_is_numeric(int type) {
+    switch (type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+        case MYSQL_TYPE_NEWDECIMAL:
+            return true;
+        default:
+            return false;
     }
-    ctx->in_transaction = false;
-    return janet_wrap_nil();
 }
 
-static Janet context_in_transaction(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 1);
-    jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
-    __ensure_ctx_ok(ctx);
-    return janet_wrap_boolean(ctx->in_transaction);
+/* Store a table map as {:database :table :types :meta :unsigned :names},
+ * with types one byte, meta two bytes and unsigned one byte per column. */
+static void binlog_table_map(jmy_binlog_t *b, jmy_cursor_t *c) {
+    uint64_t table_id = cursor_le(c, 6);
+    cursor_take(c, 2);
+    int db_len = *cursor_take(c, 1);
+    const uint8_t *db = cursor_take(c, db_len + 1);
+    int table_len = *cursor_take(c, 1);
+    const uint8_t *table = cursor_take(c, table_len + 1);
+    int n = (int)cursor_lenenc(c);
+    const uint8_t *types = cursor_take(c, n);
+
+    JanetBuffer *meta = janet_buffer(n * 2);
+    jmy_cursor_t mc = { NULL, NULL };
+    uint64_t meta_len = cursor_lenenc(c);
+    mc.p = cursor_take(c, meta_len);
+    mc.end = mc.p + meta_len;
+    for (int j = 0; j < n; j++) {
+        int size = binlog_meta_size(types[j]);
+        /* Strings, enums, sets and decimals keep their two bytes in wire
+         * order, [real type, length] and [precision, scale]. */
+        uint16_t m = size == 2 && types[j] != MYSQL_TYPE_VARCHAR && types[j] != MYSQL_TYPE_VAR_STRING &&
+                             types[j] != MYSQL_TYPE_BIT
+                     ? (uint16_t)cursor_be(&mc, 2)
+                     : (uint16_t)cursor_le(&mc, size);
+        janet_buffer_push_u8(meta, m & 0xff);
+        janet_buffer_push_u8(meta, m >> 8);
+    }
+    cursor_take(c, (n + 7) / 8);
+
+    JanetBuffer *unsig = janet_buffer(n);
+    janet_buffer_setcount(unsig, n);
+    memset(unsig->data, 0, n);
+    Janet names = janet_wrap_nil();
+
+    /* Optional metadata, sent with binlog_row_metadata=FULL. */
+    while (c->p < c->end) {
+        int field = *cursor_take(c, 1);
+        uint64_t len = cursor_lenenc(c);
+        jmy_cursor_t oc = { cursor_take(c, len), NULL };
+        oc.end = oc.p + len;
+        if (field == 1) {
+            int k = 0;
+            for (int j = 0; j < n; j++) {
+                if (binlog_is_numeric(types[j])) {
+                    unsig->data[j] = (oc.p[k / 8] >> (7 - k % 8)) & 1;
+                    k++;
+                }
+            }
+        } else if (field == 4) {
+            JanetTuple t = NULL;
+            Janet *items = janet_tuple_begin(n);
+            for (int j = 0; j < n; j++) {
+                uint64_t name_len = cursor_lenenc(&oc);
+                items[j] = janet_keywordv(cursor_take(&oc, name_len), (int32_t)name_len);
+            }
+            t = janet_tuple_end(items);
+            names = janet_wrap_tuple(t);
+        }
+    }
+
+    JanetKV *st = janet_struct_begin(6);
+    janet_struct_put(st, janet_ckeywordv("database"), janet_stringv(db, db_len));
+    janet_struct_put(st, janet_ckeywordv("table"), janet_stringv(table, table_len));
+    janet_struct_put(st, janet_ckeywordv("types"), janet_stringv(types, n));
+    janet_struct_put(st, janet_ckeywordv("meta"), janet_wrap_buffer(meta));
+    janet_struct_put(st, janet_ckeywordv("unsigned"), janet_wrap_buffer(unsig));
+    janet_struct_put(st, janet_ckeywordv("names"), names);
+    janet_table_put(b->maps, janet_wrap_number((double)table_id), janet_wrap_struct(janet_struct_end(st)));
 }
 
-static Janet context_autocommit(int32_t argc, Janet *argv) {
+/* MySQL's packed binary DECIMAL, as the text the binary protocol sends. */
+static Janet binlog_decimal(jmy_cursor_t *c, int precision, int scale) {
+    static const int dig2bytes[10] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+    if (precision < 1 || precision > 65 || scale < 0 || scale > precision) {
+        janet_panicf("bad binlog decimal(%d,%d)", precision, scale);
+    }
+    int intg = precision - scale;
+    int intg0 = intg / 9, intg0x = intg - intg0 * 9;
+    int frac0 = scale / 9, frac0x = scale - frac0 * 9;
+    int size = intg0 * 4 + dig2bytes[intg0x] + frac0 * 4 + dig2bytes[frac0x];
+
+    uint8_t bytes[64];
+    if (size > (int)sizeof(bytes)) {
+        janet_panicf("decimal(%d,%d) is too wide", precision, scale);
+    }
+    memcpy(bytes, cursor_take(c, size), size);
+    bool negative = (bytes[0] & 0x80) == 0;
+    bytes[0] ^= 0x80;
+    if (negative) {
+        for (int i = 0; i < size; i++) {
+            bytes[i] ^= 0xff;
+        }
+    }
+
+    jmy_cursor_t d = { bytes, bytes + size };
+    char text[96];
+    char *out = text;
+    if (negative) {
+        *out++ = '-';
+    }
+    char digits[80];
+    int nd = 0;
+    if (intg0x) {
+        nd += sprintf(digits + nd, "%u", (unsigned)cursor_be(&d, dig2bytes[intg0x]));
+    }
+    for (int i = 0; i < intg0; i++) {
+        nd += sprintf(digits + nd, nd ? "%09u" : "%u", (unsigned)cursor_be(&d, 4));
+    }
+    char *start = digits;
+    while (*start == '0' && start[1] != '\0') {
+        start++;
+    }
+    out += sprintf(out, "%s", nd ? start : "0");
+    if (scale > 0) {
+        *out++ = '.';
+        for (int i = 0; i < frac0; i++) {
+            out += sprintf(out, "%09u", (unsigned)cursor_be(&d, 4));
+        }
+        if (frac0x) {
+            out += sprintf(out, "%0*u", frac0x, (unsigned)cursor_be(&d, dig2bytes[frac0x]));
+        }
+    }
+    return janet_stringv((const uint8_t *)text, out - text);
+}
+
+static unsigned long binlog_fraction(jmy_cursor_t *c, int fsp) {
+    switch (fsp) {
+        case 1:
+        case 2:
+            return cursor_be(c, 1) * 10000;
+        case 3:
+        case 4:
+            return cursor_be(c, 2) * 100;
+        case 5:
+        case 6:
+            return cursor_be(c, 3);
+        default:
+            return 0;
+    }
+}
+
+static Janet binlog_value(jmy_cursor_t *c, int type, uint16_t meta, bool is_unsigned) {
+    union {
+        signed char i8;
+        short i16;
+        int i32;
+        long long i64;
+        float f;
+        double d;
+        MYSQL_TIME t;
+    } v;
+    memset(&v, 0, sizeof(v));
+    bool is_null = false;
+    unsigned long length = 0;
+    MYSQL_BIND bind;
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer = &v;
+    bind.is_null = &is_null;
+    bind.length = &length;
+    bind.buffer_type = type;
+    MYSQL_FIELD field;
+    memset(&field, 0, sizeof(field));
+    field.type = type;
+    field.length = 4;
+
+    switch (type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_LONGLONG: {
+            int size = type == MYSQL_TYPE_TINY ? 1 : type == MYSQL_TYPE_SHORT ? 2
+                       : type == MYSQL_TYPE_INT24 ? 3 : type == MYSQL_TYPE_LONG ? 4 : 8;
+            uint64_t u = cursor_le(c, size);
+            if (is_unsigned) {
+                return janet_wrap_number((double)u);
+            }
+            /* Sign extend to 64 bits. */
+            int shift = 64 - size * 8;
+            v.i64 = shift ? (long long)(u << shift) >> shift : (long long)u;
+            bind.buffer_type = MYSQL_TYPE_LONGLONG;
+            break;
+        }
+        case MYSQL_TYPE_YEAR: {
+            int year = (int)cursor_le(c, 1);
+            v.i16 = year ? 1900 + year : 0;
+            break;
+        }
+        case MYSQL_TYPE_FLOAT:
+            memcpy(&v.f, cursor_take(c, 4), 4);
+            break;
+        case MYSQL_TYPE_DOUBLE:
+            memcpy(&v.d, cursor_take(c, 8), 8);
+            break;
+        case MYSQL_TYPE_NEWDECIMAL:
+            return binlog_decimal(c, meta >> 8, meta & 0xff);
+        case MYSQL_TYPE_DATE:
+        case MYSQL_TYPE_NEWDATE: {
+            uint32_t d = (uint32_t)cursor_le(c, 3);
+            v.t.day = d & 31;
+            v.t.month = (d >> 5) & 15;
+            v.t.year = d >> 9;
+            v.t.time_type = MYSQL_TIMESTAMP_DATE;
+            bind.buffer_type = MYSQL_TYPE_DATE;
+            field.type = MYSQL_TYPE_DATE;
+            break;
+        }
+        case MYSQL_TYPE_DATETIME2: {
+            int64_t packed = (int64_t)cursor_be(c, 5) - 0x8000000000LL;
+            int64_t ymd = packed >> 17, ym = ymd >> 5, hms = packed % (1 << 17);
+            v.t.day = ymd % (1 << 5);
+            v.t.month = ym % 13;
+            v.t.year = ym / 13;
+            v.t.second = hms % (1 << 6);
+            v.t.minute = (hms >> 6) % (1 << 6);
+            v.t.hour = hms >> 12;
+            v.t.second_part = binlog_fraction(c, meta);
+            v.t.time_type = MYSQL_TIMESTAMP_DATETIME;
+            bind.buffer_type = MYSQL_TYPE_DATETIME;
+            field.type = MYSQL_TYPE_DATETIME;
+            break;
+        }
+        case MYSQL_TYPE_TIMESTAMP2:
+        case MYSQL_TYPE_TIMESTAMP: {
+            /* The binlog holds seconds since the epoch, given here in UTC
+             * as the session time zone isn't known to the stream. */
+            time_t seconds = type == MYSQL_TYPE_TIMESTAMP ? (time_t)cursor_le(c, 4) : (time_t)cursor_be(c, 4);
+            struct tm tm;
+            gmtime_r(&seconds, &tm);
+            v.t.year = tm.tm_year + 1900;
+            v.t.month = tm.tm_mon + 1;
+            v.t.day = tm.tm_mday;
+            v.t.hour = tm.tm_hour;
+            v.t.minute = tm.tm_min;
+            v.t.second = tm.tm_sec;
+            v.t.second_part = type == MYSQL_TYPE_TIMESTAMP2 ? binlog_fraction(c, meta) : 0;
+            v.t.time_type = MYSQL_TIMESTAMP_DATETIME;
+            bind.buffer_type = MYSQL_TYPE_TIMESTAMP;
+            field.type = MYSQL_TYPE_TIMESTAMP;
+            break;
+        }
+        case MYSQL_TYPE_TIME2: {
+            int64_t packed = (int64_t)cursor_be(c, 3) - 0x800000;
+            if (packed < 0) {
+                v.t.neg = true;
+                packed = -packed;
+            }
+            v.t.hour = (packed >> 12) % (1 << 10);
+            v.t.minute = (packed >> 6) % (1 << 6);
+            v.t.second = packed % (1 << 6);
+            v.t.second_part = binlog_fraction(c, meta);
+            v.t.time_type = MYSQL_TIMESTAMP_TIME;
+            bind.buffer_type = MYSQL_TYPE_TIME;
+            field.type = MYSQL_TYPE_TIME;
+            break;
+        }
+        case MYSQL_TYPE_DATETIME: {
+            uint64_t d = cursor_le(c, 8);
+            v.t.second = d % 100;
+            v.t.minute = (d / 100) % 100;
+            v.t.hour = (d / 10000) % 100;
+            v.t.day = (d / 1000000) % 100;
+            v.t.month = (d / 100000000) % 100;
+            v.t.year = d / 10000000000ULL;
+            v.t.time_type = MYSQL_TIMESTAMP_DATETIME;
+            break;
+        }
+        case MYSQL_TYPE_BIT: {
+            /* Whole bytes, then the leftover bits. */
+            int bytes = (meta >> 8) + ((meta & 0xff) + 7) / 8;
+            return janet_stringv(cursor_take(c, bytes), bytes);
+        }
+        case MYSQL_TYPE_VARCHAR:
+        case MYSQL_TYPE_VAR_STRING: {
+            length = cursor_le(c, meta < 256 ? 1 : 2);
+            bind.buffer = (void *)cursor_take(c, length);
+            bind.buffer_type = MYSQL_TYPE_VAR_STRING;
+            break;
+        }
+        case MYSQL_TYPE_STRING:
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET: {
+            int real_type = meta >> 8;
+            int max_length = meta & 0xff;
+            if ((real_type & 0x30) != 0x30) {
+                max_length |= ((real_type & 0x30) ^ 0x30) << 4;
+                real_type |= 0x30;
+            }
+            if (real_type == MYSQL_TYPE_ENUM || real_type == MYSQL_TYPE_SET) {
+                /* The member index, or the bitmask of members of a set. */
+                return janet_wrap_number((double)cursor_le(c, max_length));
+            }
+            length = cursor_le(c, max_length < 256 ? 1 : 2);
+            bind.buffer = (void *)cursor_take(c, length);
+            bind.buffer_type = MYSQL_TYPE_STRING;
+            break;
+        }
+        case MYSQL_TYPE_BLOB:
+        case MYSQL_TYPE_GEOMETRY:
+        case MYSQL_TYPE_JSON:
+            /* JSON arrives in MySQL's binary JSON encoding. */
+            length = cursor_le(c, meta);
+            bind.buffer = (void *)cursor_take(c, length);
+            bind.buffer_type = MYSQL_TYPE_BLOB;
+            break;
+        default:
+            janet_panicf("unsupported binlog column type %d", type);
+    }
+    return decode_binary(&bind, &field);
+}
+
+static Janet binlog_row(jmy_cursor_t *c, JanetStruct map, const uint8_t *present, int n) {
+    const uint8_t *types = janet_unwrap_string(janet_struct_get(map, janet_ckeywordv("types")));
+    JanetBuffer *meta = janet_unwrap_buffer(janet_struct_get(map, janet_ckeywordv("meta")));
+    JanetBuffer *unsig = janet_unwrap_buffer(janet_struct_get(map, janet_ckeywordv("unsigned")));
+    Janet names = janet_struct_get(map, janet_ckeywordv("names"));
+
+    int count = 0;
+    for (int j = 0; j < n; j++) {
+        count += bitmap_get(present, j);
+    }
+    const uint8_t *nulls = cursor_take(c, (count + 7) / 8);
+
+    JanetTable *t = janet_table(count);
+    int k = 0;
+    for (int j = 0; j < n; j++) {
+        if (!bitmap_get(present, j)) {
+            continue;
+        }
+        Janet key = janet_checktype(names, JANET_TUPLE)
+                    ? janet_unwrap_tuple(names)[j]
+                    : janet_wrap_number(j);
+        /* Like row tables elsewhere, NULL columns are simply absent. */
+        if (!bitmap_get(nulls, k++)) {
+            uint16_t m = meta->data[j * 2] | (meta->data[j * 2 + 1] << 8);
+            janet_table_put(t, key, binlog_value(c, types[j], m, unsig->data[j]));
+        }
+    }
+    return janet_wrap_table(t);
+}
+
+static Janet binlog_rows_event(jmy_binlog_t *b, jmy_cursor_t *c, int type) {
+    uint64_t table_id = cursor_le(c, 6);
+    cursor_take(c, 2);
+    if (type >= BINLOG_WRITE_ROWS_V2) {
+        uint64_t extra = cursor_le(c, 2);
+        cursor_take(c, extra - 2);
+    }
+    int n = (int)cursor_lenenc(c);
+    const uint8_t *before_cols = cursor_take(c, (n + 7) / 8);
+    const uint8_t *after_cols = before_cols;
+    bool update = type == BINLOG_UPDATE_ROWS_V1 || type == BINLOG_UPDATE_ROWS_V2;
+    if (update) {
+        after_cols = cursor_take(c, (n + 7) / 8);
+    }
+
+    Janet map = janet_table_get(b->maps, janet_wrap_number((double)table_id));
+    if (!janet_checktype(map, JANET_STRUCT)) {
+        janet_panicf("binlog rows for unknown table id %d", (int32_t)table_id);
+    }
+    JanetStruct st = janet_unwrap_struct(map);
+    int32_t map_n = janet_string_length(janet_unwrap_string(janet_struct_get(st, janet_ckeywordv("types"))));
+    if (n != map_n) {
+        janet_panicf("binlog rows event has %d columns but its table map has %d", n, map_n);
+    }
+
+    JanetArray *rows = janet_array(1);
+    while (c->p < c->end) {
+        Janet row = binlog_row(c, st, before_cols, n);
+        if (update) {
+            Janet pair[2] = { row, binlog_row(c, st, after_cols, n) };
+            row = janet_wrap_tuple(janet_tuple_n(pair, 2));
+        }
+        janet_array_push(rows, row);
+    }
+
+    const char *kind = update ? "update"
+                       : (type == BINLOG_WRITE_ROWS_V1 || type == BINLOG_WRITE_ROWS_V2) ? "insert" : "delete";
+    JanetTable *event = janet_table(6);
+    janet_table_put(event, janet_ckeywordv("type"), janet_ckeywordv(kind));
+    janet_table_put(event, janet_ckeywordv("database"), janet_struct_get(st, janet_ckeywordv("database")));
+    janet_table_put(event, janet_ckeywordv("table"), janet_struct_get(st, janet_ckeywordv("table")));
+    janet_table_put(event, janet_ckeywordv("rows"), janet_wrap_array(rows));
+    return janet_wrap_table(event);
+}
+
+static Janet binlog_open(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     jmy_context_t *ctx = (jmy_context_t *)janet_getabstract(argv, 0, &context_type);
+    JanetStruct opts = janet_getstruct(argv, 1);
     __ensure_ctx_ok(ctx);
-    bool ok = janet_getboolean(argv, 1);
-    if (mysql_autocommit(ctx->conn, ok)) {
-        janet_panicf("mysql_commit failed %s\n", mysql_error(ctx->conn));
+
+    jmy_binlog_t *b = (jmy_binlog_t *)janet_abstract(&binlog_type, sizeof(jmy_binlog_t));
+    memset(b, 0, sizeof(jmy_binlog_t));
+    b->ctx = ctx;
+    b->maps = janet_table(0);
+
+    Janet file = janet_struct_get(opts, janet_ckeywordv("file"));
+    if (janet_checktype(file, JANET_STRING)) {
+        snprintf(b->file, sizeof(b->file), "%s", (const char *)janet_unwrap_string(file));
+    }
+    Janet position = janet_struct_get(opts, janet_ckeywordv("position"));
+    Janet server_id = janet_struct_get(opts, janet_ckeywordv("server-id"));
+    b->checksum = janet_truthy(janet_struct_get(opts, janet_ckeywordv("checksum")));
+
+    b->rpl.file_name = b->file;
+    b->rpl.file_name_length = strlen(b->file);
+    b->rpl.start_position = janet_checktype(position, JANET_NUMBER) ? (uint64_t)janet_unwrap_number(position) : 4;
+    snprintf(b->safe_file, sizeof(b->safe_file), "%s", b->file);
+    b->safe_position = b->rpl.start_position;
+    b->rpl.server_id = janet_checktype(server_id, JANET_NUMBER) ? (unsigned int)janet_unwrap_number(server_id) : 1000001;
+    Janet block = janet_struct_get(opts, janet_ckeywordv("block"));
+    b->rpl.flags = janet_checktype(block, JANET_BOOLEAN) && !janet_truthy(block) ? BINLOG_DUMP_NON_BLOCK : 0;
+
+    if (mysql_binlog_open(ctx->conn, &b->rpl)) {
+        conn_panic(ctx->conn, "mysql_binlog_open");
+    }
+    b->open = true;
+    ctx->dumping = true;
+    return janet_wrap_abstract(b);
+}
+
+static Janet binlog_next(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_binlog_t *b = (jmy_binlog_t *)janet_getabstract(argv, 0, &binlog_type);
+    if (!b->open || b->ctx->conn == NULL) {
+        janet_panic("mysql/binlog is closed");
+    }
+    MYSQL *conn = b->ctx->conn;
+
+    for (;;) {
+        if (mysql_binlog_fetch(conn, &b->rpl)) {
+            conn_panic(conn, "mysql_binlog_fetch");
+        }
+        if (b->rpl.size == 0) {
+            return janet_wrap_nil();
+        }
+        /* Skip the OK byte in front of every event. */
+        jmy_cursor_t c = { b->rpl.buffer + 1, b->rpl.buffer + b->rpl.size };
+        if (b->checksum) {
+            c.end -= 4;
+        }
+        cursor_take(&c, 4);
+        int type = *cursor_take(&c, 1);
+        cursor_take(&c, 8);
+        uint64_t next_position = cursor_le(&c, 4);
+        cursor_take(&c, 2);
+
+        Janet event;
+        bool commit = false;
+        switch (type) {
+            case BINLOG_ROTATE_EVENT:
+                /* Rotation happens between transactions. */
+                b->safe_position = cursor_le(&c, 8);
+                snprintf(b->file, sizeof(b->file), "%.*s", (int)(c.end - c.p), (const char *)c.p);
+                snprintf(b->safe_file, sizeof(b->safe_file), "%s", b->file);
+                continue;
+            case BINLOG_QUERY_EVENT: {
+                /* Non-transactional tables end their changes with a COMMIT
+                 * query rather than an XID. */
+                cursor_take(&c, 8);
+                size_t db_len = *cursor_take(&c, 1);
+                cursor_take(&c, 2);
+                size_t vars_len = cursor_le(&c, 2);
+                cursor_take(&c, vars_len + db_len + 1);
+                if (c.end - c.p != 6 || memcmp(c.p, "COMMIT", 6)) {
+                    continue;
+                }
+                JanetTable *t = janet_table(4);
+                janet_table_put(t, janet_ckeywordv("type"), janet_ckeywordv("commit"));
+                event = janet_wrap_table(t);
+                commit = true;
+                break;
+            }
+            case BINLOG_TABLE_MAP_EVENT:
+                binlog_table_map(b, &c);
+                continue;
+            case BINLOG_WRITE_ROWS_V1:
+            case BINLOG_UPDATE_ROWS_V1:
+            case BINLOG_DELETE_ROWS_V1:
+            case BINLOG_WRITE_ROWS_V2:
+            case BINLOG_UPDATE_ROWS_V2:
+            case BINLOG_DELETE_ROWS_V2:
+                event = binlog_rows_event(b, &c, type);
+                break;
+            case BINLOG_XID_EVENT: {
+                JanetTable *t = janet_table(4);
+                janet_table_put(t, janet_ckeywordv("type"), janet_ckeywordv("commit"));
+                janet_table_put(t, janet_ckeywordv("xid"), janet_wrap_number((double)cursor_le(&c, 8)));
+                event = janet_wrap_table(t);
+                commit = true;
+                break;
+            }
+            default:
+                continue;
+        }
+        if (commit) {
+            snprintf(b->safe_file, sizeof(b->safe_file), "%s", b->file);
+            b->safe_position = next_position;
+        }
+        /* Resuming from :file and :position replays the transaction that
+         * is still open, a row event can't be resumed from midway. */
+        JanetTable *t = janet_unwrap_table(event);
+        janet_table_put(t, janet_ckeywordv("file"), janet_cstringv(b->safe_file));
+        janet_table_put(t, janet_ckeywordv("position"), janet_wrap_number((double)b->safe_position));
+        return event;
+    }
+}
+
+static Janet binlog_close(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    jmy_binlog_t *b = (jmy_binlog_t *)janet_getabstract(argv, 0, &binlog_type);
+    if (b->open) {
+        b->open = false;
+        if (b->ctx->conn != NULL) {
+            mysql_binlog_close(b->ctx->conn, &b->rpl);
+        }
+        /* A connection in the middle of a dump can't serve queries again. */
+        b->ctx->dumping = false;
+        context_close_i(b->ctx);
     }
     return janet_wrap_nil();
 }
@@ -1310,17 +5796,113 @@ static const JanetReg cfuns[] = {
     // exec and select.
     {"exec", context_exec, "See mysql/exec"},
     {"select", context_select, "See mysql/select"},
+    {"select-unbuffered", context_select_unbuffered, "See mysql/select-unbuffered"},
+    {
+        "select-concurrent", context_select_concurrent,
+        "(mysql/select-concurrent conns query & params)\n\n"
+        "Send query to every connection in conns before reading any results, "
+        "so the servers execute it concurrently. Returns an array of buffered "
+        "mysql/rows in the order of conns."
+    },
+    {
+        "select-hedged", context_select_hedged,
+        "(mysql/select-hedged conns delay query & params)\n\n"
+        "Send query to the first connection in conns, and to the next whenever delay "
+        "seconds pass without an answer. The first to answer wins and the query is killed "
+        "on the rest, whose results are discarded when each is next used. Returns "
+        "[rows winner sent kill-failures], winner being the index of the connection whose "
+        "buffered rows are returned, sent the number of connections queried and "
+        "kill-failures the number of losing queries that couldn't be killed."
+    },
+    {
+        "binlog-open", binlog_open,
+        "(mysql/binlog-open conn opts)\n\n"
+        "Register conn as a replica and start streaming the binlog. See mysql/binlog-events."
+    },
+    {
+        "binlog-next", binlog_next,
+        "(mysql/binlog-next binlog)\n\n"
+        "Return the next row or commit event, or nil at the end of a nonblocking stream."
+    },
+    {
+        "binlog-close", binlog_close,
+        "(mysql/binlog-close binlog)\n\n"
+        "Stop the stream and close its connection."
+    },
+    {
+        "cancel", context_cancel,
+        "(mysql/cancel conn)\n\n"
+        "Kill the query running on conn from a side connection, leaving conn usable. "
+        "The interrupted call fails with errno 1317. Returns true if the kill was sent."
+    },
+    {
+        "watch-new", watch_new,
+        "(mysql/watch-new)\n\n"
+        "Return an empty watch state for mysql/watch-diff."
+    },
+    {
+        "watch-diff", watch_diff,
+        "(mysql/watch-diff state rows key-cols)\n\n"
+        "Compare buffered text rows with the rows state last saw, by the raw bytes "
+        "of each row keyed by key-cols, and remember them. Returns "
+        "{:inserted :updated :deleted}, decoding only changed rows, and only the key "
+        "columns of deleted ones. See mysql/watch."
+    },
+    {"row", context_row, "See mysql/row"},
+    {"val", context_val, "See mysql/val"},
+    {"col", context_col, "See mysql/col"},
+
+    {
+        "warm-up", context_warm_up,
+        "(mysql/warm-up config n &opt init queries)\n\n"
+        "Open n connections at once, one thread each, then run the init statements "
+        "and prepare queries on every one. Returns {:conns :statements :timings}, "
+        "with an array of statements per connection. See mysql/warm-up."
+    },
 
     // statements.
     {"prepare", context_prepare, "See mysql/exec"},
     {"stmt-close", stmt_close, "See mysql/exec"},
+    {
+        "stmt-live?", stmt_live,
+        "(mysql/stmt-live? stmt)\n\n"
+        "False if stmt was closed, its connection closed, or the connection reset since it was prepared."
+    },
+    {
+        "reset-connection", context_reset_connection,
+        "(mysql/reset-connection conn)\n\n"
+        "Reset the session state of conn without reconnecting, rolling back any transaction "
+        "and closing its prepared statements."
+    },
 
     // transactions.
     {"begin", context_begin, upstream_doc},
     {"commit", context_commit, upstream_doc},
+    {
+        "exec-commit", context_exec_commit,
+        "(mysql/exec-commit conn query & params)\n\n"
+        "Execute a statement and commit the current transaction in one round trip."
+    },
     {"rollback", context_rollback, upstream_doc},
     {"in-transaction", context_in_transaction, upstream_doc},
 
+    // errors.
+    {
+        "error?", error_p,
+        "(mysql/error? v)\n\n"
+        "Check if v is an error raised by mysql."
+    },
+    {
+        "error-errno", error_errno,
+        "(mysql/error-errno err)\n\n"
+        "Return the mysql error number of err."
+    },
+    {
+        "error-sqlstate", error_sqlstate,
+        "(mysql/error-sqlstate err)\n\n"
+        "Return the SQLSTATE of err."
+    },
+
     // result functions
     {"result-insert-id", result_insert_id, upstream_doc},
     {"result-affected-rows", result_affected_rows, upstream_doc},
@@ -1329,13 +5911,95 @@ static const JanetReg cfuns[] = {
     {"rows-columns", rows_columns, upstream_doc},
     {"rows-column-types", rows_column_types, upstream_doc},
     {"rows-unpack", rows_unpack, upstream_doc},
+    {
+        "rows-prefetch", rows_prefetch,
+        "(mysql/rows-prefetch rows &opt depth batch-rows)\n\n"
+        "Start a native thread reading unbuffered rows ahead into batches of "
+        "batch-rows (default 1024), holding at most depth (default 4) batches "
+        "before waiting for them to be taken. The connection can't be used until "
+        "every batch has been read or the rows are freed. Reading ahead isn't watched "
+        "by :mysql/timeout, only the select's MAX_EXECUTION_TIME hint bounds it. Returns rows."
+    },
+    {
+        "rows-next-batch", rows_next_batch,
+        "(mysql/rows-next-batch rows &opt wait)\n\n"
+        "Return the next batch of prefetched rows as an array of tables, waiting "
+        "for the reader thread if needed, or nil once all rows have been read. "
+        "When wait is false, returns false instead of waiting."
+    },
+    {
+        "rows-unpack-columns", rows_unpack_columns,
+        "(mysql/rows-unpack-columns rows &opt threads)\n\n"
+        "Return a table mapping each column name to an array of its values. "
+        "For large buffered text results, number and time columns are parsed "
+        "on up to threads native threads before the values are boxed."
+    },
+    {
+        "rows-unpack-into", rows_unpack_into,
+        "(mysql/rows-unpack-into rows arr)\n\n"
+        "Like rows-unpack, but refill the row tables already in arr and resize it "
+        "to the number of rows. Unchanged strings are kept, so polling the same "
+        "query allocates little beyond the values that changed. Returns arr."
+    },
+    {
+        "rows-free", rows_free,
+        "(mysql/rows-free rows)\n\n"
+        "Release the memory held by rows without waiting for the garbage collector. "
+        "Rows can also be bound with `with`."
+    },
+    {
+        "rows-export-chunk", rows_export_chunk,
+        "(mysql/rows-export-chunk rows buffer opts &opt header)\n\n"
+        "Append rows to buffer as CSV or TSV until it holds :chunk-size bytes. "
+        "Returns true if rows may remain. See mysql/rows-export."
+    },
+    {
+        "rows-write-json", rows_write_json,
+        "(mysql/rows-write-json rows buffer)\n\n"
+        "Write rows to buffer as a JSON array of objects without building Janet tables. "
+        "JSON columns are embedded as is. Buffered rows are written from the start each time. "
+        "Returns buffer."
+    },
+    {
+        "rows-save", rows_save,
+        "(mysql/rows-save rows path)\n\n"
+        "Decode rows and save them to path as a columnar snapshot file, replacing "
+        "it atomically. See mysql/snapshot-open."
+    },
+    {
+        "snapshot-open", snapshot_open,
+        "(mysql/snapshot-open path)\n\n"
+        "Map a file written by mysql/rows-save read only. The mysql/snapshot "
+        "supports the same row access as buffered mysql/rows, as well as "
+        "rows-columns, rows-column-types, rows-unpack and rows-unpack-columns, "
+        "without decoding anything up front. Processes opening the same file "
+        "share its pages."
+    },
+    {
+        "snapshot-column", snapshot_column_values,
+        "(mysql/snapshot-column snapshot col)\n\n"
+        "Return an array of the values of column col, a name or an index."
+    },
 
     {NULL, NULL, NULL}
 };
 
 JANET_MODULE_ENTRY(JanetTable *env) {
+    decoders_registry = janet_table(0);
+    janet_def(env, "*decoders*", janet_wrap_table(decoders_registry),
+              "Table of column representations, keyed by column name strings or type "
+              "keywords such as :datetime, :decimal, :enum or :blob. Values are :default, "
+              ":raw for the value's text, :epoch for temporal types as seconds since the "
+              "epoch, :fixed for DECIMAL as an int/s64 of units of its scale, :number for "
+              "DECIMAL as a float, or a function called with the raw text. The "
+              ":mysql/decoders dynamic binding replaces the table. Columns are resolved "
+              "once per result.");
 
     janet_cfuns(env, "pq", cfuns);
     janet_register_abstract_type(&context_type);
     janet_register_abstract_type(&rows_type);
+    janet_register_abstract_type(&row_type);
+    janet_register_abstract_type(&error_type);
+    janet_register_abstract_type(&binlog_type);
+    janet_register_abstract_type(&snapshot_type);
 }